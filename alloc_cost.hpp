@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "phase_memory.hpp"
+
+// 一个循环的 IR 压力估计、指令选择之后实际的 MaxLive 和分配加入的 spill load / store 数目
+struct LoopPressureCost {
+  i32 depth;
+  i32 ir_estimate;
+  i32 post_isel;
+  i32 spill_insts;
+};
+
+// allocate_register 对每个函数记录的代价，写入 stats JSON；alloc_fuzz.cpp 用它衡量生成的输入
+struct AllocCost {
+  std::string name;
+  i32 insts;
+  i32 rounds;
+  double ms;
+  bool fallback;  // spill 轮数或时间超出预算，回退到栈上
+  std::vector<PhaseMemoryUsage> memory;
+  std::vector<LoopPressureCost> loops;
+};
+
+// 最近一次 allocate_register 中各函数的代价，按函数的顺序
+const std::vector<AllocCost> &last_alloc_costs();
@@ -0,0 +1,703 @@
+// 寄存器分配的性能 fuzzer：生成并变异合成的 MachineFunc，寻找分配耗时随规模超线性增长的输入，
+// 最小化之后存入 corpus，作为回归测试在用户遇到之前发现这类问题。
+// 不属于编译器本身：定义 ALLOC_FUZZ，与除 main.cpp 以外的源文件一起编译成单独的程序
+//   alloc_fuzz <corpus 目录> [迭代次数] [随机种子]   搜索，新发现的输入写到 corpus 目录
+//   alloc_fuzz --replay <corpus 目录>               重新测量 corpus 中的输入，仍然超线性时返回 1
+#ifdef ALLOC_FUZZ
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+
+#include "alloc_cost.hpp"
+#include "allocate_register.hpp"
+
+/********************************
+ * 合成函数
+ * 用块和指令的简单描述表示，变异、最小化和存盘都在描述上进行，每次测量时重新生成 MachineFunc。
+ * 入口块先给所有 vreg 赋初值，最后一个块把 v0 放到 r0 返回。
+ * 每个块都落到下一个块，target 不为 -1 时块末尾还有一条到 target 的条件跳转，所以每个块都可达
+ */
+enum class FuzzOp { Add, Sub, Mul, AddImm, Move, Load, Store, Compare, Call, Count };
+
+static const char *fuzz_op_name[] = {"add", "sub", "mul", "addi", "mov", "ldr", "str", "cmp", "call"};
+
+// add / sub / mul: dst = lhs op rhs；addi: dst = lhs + #rhs；mov: dst = lhs；ldr: dst = [lhs]；
+// str: [lhs] = dst；cmp: lhs, rhs；call 不使用操作数
+struct FuzzInst {
+  FuzzOp op;
+  i32 dst, lhs, rhs;
+};
+
+struct FuzzBlock {
+  std::vector<FuzzInst> insts;
+  i32 target = -1;
+};
+
+struct FuzzFunc {
+  i32 vregs = 1;
+  std::vector<FuzzBlock> blocks;
+};
+
+static i32 fuzz_insts(const FuzzFunc &ff) {
+  i32 n = 0;
+  for (auto &b : ff.blocks) {
+    n += b.insts.size();
+  }
+  return n;
+}
+
+static std::string serialize(const FuzzFunc &ff) {
+  std::ostringstream os;
+  os << "vregs " << ff.vregs << "\n";
+  for (auto &b : ff.blocks) {
+    os << "block " << b.target << "\n";
+    for (auto &i : b.insts) {
+      os << fuzz_op_name[(i32)i.op] << " " << i.dst << " " << i.lhs << " " << i.rhs << "\n";
+    }
+  }
+  return os.str();
+}
+
+// 格式错误时返回 false
+static bool parse(std::istream &is, FuzzFunc &ff) {
+  ff = FuzzFunc();
+  std::string line;
+  while (std::getline(is, line)) {
+    std::istringstream ls(line);
+    std::string word;
+    if (!(ls >> word) || word[0] == '#') {
+      continue;
+    }
+    if (word == "vregs") {
+      ls >> ff.vregs;
+    } else if (word == "block") {
+      ff.blocks.emplace_back();
+      ls >> ff.blocks.back().target;
+    } else {
+      auto it = std::find_if(std::begin(fuzz_op_name), std::end(fuzz_op_name),
+                             [&](const char *name) { return word == name; });
+      FuzzInst inst;
+      if (it == std::end(fuzz_op_name) || ff.blocks.empty() || !(ls >> inst.dst >> inst.lhs >> inst.rhs)) {
+        return false;
+      }
+      inst.op = (FuzzOp)(it - std::begin(fuzz_op_name));
+      ff.blocks.back().insts.push_back(inst);
+    }
+  }
+  if (ff.vregs < 1 || ff.blocks.empty()) {
+    return false;
+  }
+  for (auto &b : ff.blocks) {
+    if (b.target < -1 || b.target >= (i32)ff.blocks.size()) {
+      return false;
+    }
+    for (auto &i : b.insts) {
+      bool imm = i.op == FuzzOp::AddImm;
+      if (std::min(i.dst, i.lhs) < 0 || std::max(i.dst, i.lhs) >= ff.vregs || i.rhs < 0 ||
+          (!imm && i.rhs >= ff.vregs) || (imm && i.rhs >= 256)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// SysY 只会产生可归约的 CFG：去掉指向支配者的边之后没有环
+static bool reducible(const FuzzFunc &ff) {
+  i32 n = ff.blocks.size();
+  std::vector<std::vector<i32>> succ(n), pred(n);
+  for (i32 k = 0; k < n; k++) {
+    auto add = [&](i32 t) {
+      succ[k].push_back(t);
+      pred[t].push_back(k);
+    };
+    if (k + 1 < n) {
+      add(k + 1);
+    }
+    if (ff.blocks[k].target != -1 && k + 1 < n) {
+      add(ff.blocks[k].target);
+    }
+  }
+  // 每个块都从入口沿落空边可达，按编号顺序迭代即可
+  std::vector<std::vector<bool>> dom(n, std::vector<bool>(n, true));
+  dom[0].assign(n, false);
+  dom[0][0] = true;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (i32 k = 1; k < n; k++) {
+      std::vector<bool> d(n, true);
+      for (i32 p : pred[k]) {
+        for (i32 j = 0; j < n; j++) {
+          d[j] = d[j] && dom[p][j];
+        }
+      }
+      d[k] = true;
+      if (d != dom[k]) {
+        dom[k] = d;
+        changed = true;
+      }
+    }
+  }
+  std::vector<i32> indegree(n);
+  for (i32 k = 0; k < n; k++) {
+    for (i32 t : succ[k]) {
+      indegree[t] += !dom[k][t];
+    }
+  }
+  std::vector<i32> ready = {0};
+  i32 visited = 0;
+  while (!ready.empty()) {
+    i32 k = ready.back();
+    ready.pop_back();
+    visited++;
+    for (i32 t : succ[k]) {
+      if (!dom[k][t] && --indegree[t] == 0) {
+        ready.push_back(t);
+      }
+    }
+  }
+  return visited == n;
+}
+
+static MachineFunc *build_machine_func(const FuzzFunc &ff) {
+  static Func callee;  // 没有参数
+  static Func func;
+  static IrFunc ir;
+  func.name = "fuzz";
+  ir.func = &func;
+
+  auto f = new MachineFunc();
+  f->func = &ir;
+  f->stack_size = 0;
+  f->virtual_max = ff.vregs;
+  std::vector<MachineBB *> bbs;
+  for (size_t k = 0; k < ff.blocks.size(); k++) {
+    auto bb = new MachineBB(nullptr);
+    bb->succ = {nullptr, nullptr};
+    f->bb.insertAtEnd(bb);
+    bbs.push_back(bb);
+  }
+  for (i32 v = 0; v < ff.vregs; v++) {
+    auto mv = new MIMove(bbs[0]);
+    mv->dst = MachineOperand::V(v);
+    mv->rhs = MachineOperand::I(v);
+  }
+  for (size_t k = 0; k < ff.blocks.size(); k++) {
+    auto bb = bbs[k];
+    for (auto &i : ff.blocks[k].insts) {
+      auto V = [](i32 v) { return MachineOperand::V(v); };
+      switch (i.op) {
+        case FuzzOp::Add:
+        case FuzzOp::Sub:
+        case FuzzOp::Mul:
+        case FuzzOp::AddImm: {
+          auto tag = i.op == FuzzOp::Sub ? MachineInst::Tag::Sub
+                                         : i.op == FuzzOp::Mul ? MachineInst::Tag::Mul : MachineInst::Tag::Add;
+          auto x = new MIBinary(tag, bb);
+          x->dst = V(i.dst);
+          x->lhs = V(i.lhs);
+          x->rhs = i.op == FuzzOp::AddImm ? MachineOperand::I(i.rhs) : V(i.rhs);
+          break;
+        }
+        case FuzzOp::Move: {
+          auto x = new MIMove(bb);
+          x->dst = V(i.dst);
+          x->rhs = V(i.lhs);
+          break;
+        }
+        case FuzzOp::Load: {
+          auto x = new MILoad(bb);
+          x->dst = V(i.dst);
+          x->addr = V(i.lhs);
+          x->offset = MachineOperand::I(0);
+          x->shift = 0;
+          break;
+        }
+        case FuzzOp::Store: {
+          auto x = new MIStore(bb);
+          x->data = V(i.dst);
+          x->addr = V(i.lhs);
+          x->offset = MachineOperand::I(0);
+          x->shift = 0;
+          break;
+        }
+        case FuzzOp::Compare: {
+          auto x = new MICompare(bb);
+          x->lhs = V(i.lhs);
+          x->rhs = V(i.rhs);
+          break;
+        }
+        case FuzzOp::Call: {
+          auto x = new MICall(bb);
+          x->func = &callee;
+          break;
+        }
+        default:
+          break;
+      }
+    }
+    if (k + 1 == ff.blocks.size()) {
+      auto mv = new MIMove(bb);
+      mv->dst = MachineOperand::R(ArmReg::r0);
+      mv->rhs = MachineOperand::V(0);
+      new MIReturn(bb);
+      continue;
+    }
+    bb->succ[0] = bbs[k + 1];
+    i32 t = ff.blocks[k].target;
+    if (t != -1) {
+      auto br = new MIBranch(bb);
+      br->cond = ArmCond::Lt;
+      br->target = bbs[t];
+      bb->succ = {bbs[t], bbs[k + 1]};
+    }
+  }
+  return f;
+}
+
+// MachineInst 没有虚析构函数，按实际类型删除
+static void delete_inst(MachineInst *inst) {
+  if (auto x = dyn_cast<MIBinary>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MILongMul>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MIFma>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MIMove>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MIBranch>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MIJump>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MIReturn>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MILoad>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MIStore>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MICompare>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MICall>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
+    delete x;
+  } else if (auto x = dyn_cast<MIComment>(inst)) {
+    delete x;
+  }
+}
+
+static void delete_machine_func(MachineFunc *f) {
+  for (auto bb = f->bb.head; bb;) {
+    for (auto inst = bb->insts.head; inst;) {
+      auto next = inst->next;
+      delete_inst(inst);
+      inst = next;
+    }
+    auto next = bb->next;
+    delete bb;
+    bb = next;
+  }
+  delete f;
+}
+
+/********************************
+ * 测量
+ * 分配一次生成的函数，耗时和轮数取 allocate_register 记录的代价。
+ * 增长指数：把函数体重复 1、2、4、8 次（vreg 共用，变量一样多、代码更长），
+ * 在 log-log 坐标上拟合耗时随指令数增长的指数，超过 SUPERLINEAR_EXPONENT 时认为是超线性的。
+ * 很小的函数耗时以固定开销为主，指数没有意义，最大规模的耗时不到 MIN_SUPERLINEAR_MS 时不算
+ */
+constexpr i32 GROWTH_SCALES[] = {1, 2, 4, 8};
+constexpr i32 MEASURE_REPEATS = 3;
+constexpr double SUPERLINEAR_EXPONENT = 1.5;
+constexpr double MIN_SUPERLINEAR_MS = 5;
+
+static AllocCost measure(const FuzzFunc &ff) {
+  auto f = build_machine_func(ff);
+  MachineProgram p;
+  p.func.insertAtEnd(f);
+  allocate_register(&p);
+  p.func.remove(f);
+  delete_machine_func(f);
+  return last_alloc_costs().front();
+}
+
+static FuzzFunc scaled(const FuzzFunc &ff, i32 times) {
+  FuzzFunc s;
+  s.vregs = ff.vregs;
+  i32 n = ff.blocks.size();
+  for (i32 r = 0; r < times; r++) {
+    for (auto b : ff.blocks) {
+      if (b.target != -1) {
+        b.target += r * n;
+      }
+      s.blocks.push_back(b);
+    }
+  }
+  return s;
+}
+
+// 最小二乘拟合 log(ms) = a + k * log(insts)，返回 k
+static double fit_growth(const std::vector<std::pair<double, double>> &points) {
+  double n = points.size(), sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (auto [insts, ms] : points) {
+    double x = std::log(insts), y = std::log(std::max(ms, 1e-3));
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  double var = n * sxx - sx * sx;
+  return var > 1e-9 ? (n * sxy - sx * sy) / var : 0;
+}
+
+struct Growth {
+  double exponent;
+  AllocCost largest;  // 最大规模的一次，耗时取几次中最短的
+};
+
+static Growth measure_growth(const FuzzFunc &ff) {
+  std::vector<std::pair<double, double>> points;
+  AllocCost largest;
+  for (i32 times : GROWTH_SCALES) {
+    auto s = scaled(ff, times);
+    AllocCost best = measure(s);
+    for (i32 r = 1; r < MEASURE_REPEATS; r++) {
+      auto c = measure(s);
+      if (c.ms < best.ms) {
+        best = c;
+      }
+    }
+    points.push_back({(double)best.insts, best.ms});
+    largest = best;
+  }
+  return {fit_growth(points), largest};
+}
+
+static bool superlinear(const Growth &g) {
+  return g.exponent > SUPERLINEAR_EXPONENT && g.largest.ms >= MIN_SUPERLINEAR_MS;
+}
+
+/********************************
+ * 变异
+ * 插入、删除、复制指令，拆分、复制块，增加或删除条件跳转，增加 vreg 并在之后的块中使用，
+ * 得到不可归约的 CFG 或超过 MAX_FUZZ_INSTS 条指令时重试
+ */
+constexpr i32 MAX_FUZZ_INSTS = 1500;
+constexpr i32 MAX_FUZZ_VREGS = 64;
+
+struct Mutator {
+  std::mt19937 rng;
+
+  explicit Mutator(u32 seed) : rng(seed) {}
+
+  i32 pick(i32 n) { return n <= 0 ? 0 : (i32)(rng() % n); }
+
+  FuzzInst random_inst(i32 vregs) {
+    auto op = (FuzzOp)pick((i32)FuzzOp::Count);
+    i32 rhs = op == FuzzOp::AddImm ? pick(256) : pick(vregs);
+    return {op, pick(vregs), pick(vregs), rhs};
+  }
+
+  FuzzFunc random_func() {
+    FuzzFunc ff;
+    ff.vregs = 4 + pick(20);
+    ff.blocks.resize(1 + pick(8));
+    for (auto &b : ff.blocks) {
+      for (i32 k = 1 + pick(20); k > 0; k--) {
+        b.insts.push_back(random_inst(ff.vregs));
+      }
+    }
+    for (i32 k = 0; k < 3; k++) {
+      add_branch(ff);
+    }
+    return reducible(ff) ? ff : random_func();
+  }
+
+  void add_branch(FuzzFunc &ff) {
+    i32 k = pick(ff.blocks.size());
+    ff.blocks[k].target = pick(ff.blocks.size());
+  }
+
+  // 在 k 之后插入块 b，之后的跳转目标后移
+  static void insert_block(FuzzFunc &ff, i32 k, FuzzBlock b) {
+    for (auto &x : ff.blocks) {
+      if (x.target > k) {
+        x.target++;
+      }
+    }
+    if (b.target > k) {
+      b.target++;
+    }
+    ff.blocks.insert(ff.blocks.begin() + k + 1, b);
+  }
+
+  void mutate_once(FuzzFunc &ff) {
+    auto &b = ff.blocks[pick(ff.blocks.size())];
+    switch (pick(8)) {
+      case 0:
+        b.insts.insert(b.insts.begin() + pick(b.insts.size() + 1), random_inst(ff.vregs));
+        break;
+      case 1:
+        if (!b.insts.empty()) {
+          b.insts.erase(b.insts.begin() + pick(b.insts.size()));
+        }
+        break;
+      case 2: {  // 复制一段指令到同一个块的另一个位置
+        if (b.insts.empty()) {
+          break;
+        }
+        i32 from = pick(b.insts.size()), len = 1 + pick(b.insts.size() - from);
+        std::vector<FuzzInst> chunk(b.insts.begin() + from, b.insts.begin() + from + len);
+        b.insts.insert(b.insts.begin() + pick(b.insts.size() + 1), chunk.begin(), chunk.end());
+        break;
+      }
+      case 3: {  // 拆分块，条件跳转留在后一半的末尾
+        i32 k = &b - &ff.blocks[0], at = pick(b.insts.size() + 1);
+        FuzzBlock tail;
+        tail.insts.assign(b.insts.begin() + at, b.insts.end());
+        tail.target = b.target;
+        b.insts.resize(at);
+        b.target = -1;
+        insert_block(ff, k, tail);
+        break;
+      }
+      case 4: {
+        i32 k = &b - &ff.blocks[0];
+        insert_block(ff, k, b);
+        break;
+      }
+      case 5:
+        add_branch(ff);
+        break;
+      case 6:
+        b.target = -1;
+        break;
+      case 7: {  // 新的 vreg 在入口定义，在随机的块中使用，活跃范围很长
+        if (ff.vregs >= MAX_FUZZ_VREGS) {
+          break;
+        }
+        i32 v = ff.vregs++;
+        auto &use = ff.blocks[pick(ff.blocks.size())].insts;
+        use.push_back({FuzzOp::Add, pick(v), pick(v), v});
+        break;
+      }
+    }
+  }
+
+  FuzzFunc mutate(const FuzzFunc &parent) {
+    while (true) {
+      FuzzFunc ff = parent;
+      for (i32 k = 1 + pick(4); k > 0; k--) {
+        mutate_once(ff);
+      }
+      if (reducible(ff) && fuzz_insts(ff) <= MAX_FUZZ_INSTS) {
+        return ff;
+      }
+    }
+  }
+};
+
+/********************************
+ * 最小化
+ * 贪心地删除块、成段删除指令（段长从块长的一半减到 1）、删除条件跳转，结果仍然超线性时保留，
+ * 直到一遍下来没有变化或者测量次数超过 MAX_MINIMIZE_STEPS。最后去掉没有用到的 vreg。
+ * 少于 MIN_FUZZ_INSTS 条指令的函数以固定开销为主，不再缩小
+ */
+constexpr i32 MAX_MINIMIZE_STEPS = 300;
+constexpr i32 MIN_FUZZ_INSTS = 40;
+
+static FuzzFunc remove_block(const FuzzFunc &ff, i32 k) {
+  FuzzFunc c = ff;
+  c.blocks.erase(c.blocks.begin() + k);
+  for (auto &b : c.blocks) {
+    if (b.target > k) {
+      b.target--;
+    } else if (b.target == k && k == (i32)c.blocks.size()) {
+      b.target = -1;
+    }
+  }
+  return c;
+}
+
+// v0 被返回，保持不变
+static FuzzFunc compact_vregs(const FuzzFunc &ff) {
+  std::vector<i32> id(ff.vregs, -1);
+  id[0] = 0;
+  i32 n = 1;
+  auto rename = [&](i32 &v) {
+    if (id[v] == -1) {
+      id[v] = n++;
+    }
+    v = id[v];
+  };
+  FuzzFunc c = ff;
+  for (auto &b : c.blocks) {
+    for (auto &i : b.insts) {
+      rename(i.dst);
+      rename(i.lhs);
+      if (i.op != FuzzOp::AddImm) {
+        rename(i.rhs);
+      }
+    }
+  }
+  c.vregs = n;
+  return c;
+}
+
+static FuzzFunc minimize(FuzzFunc ff, Growth &growth) {
+  i32 steps = 0;
+  auto keep = [&](const FuzzFunc &c) {
+    if (steps >= MAX_MINIMIZE_STEPS || fuzz_insts(c) < MIN_FUZZ_INSTS || !reducible(c)) {
+      return false;
+    }
+    steps++;
+    auto g = measure_growth(c);
+    if (!superlinear(g)) {
+      return false;
+    }
+    ff = c;
+    growth = g;
+    return true;
+  };
+  for (bool changed = true; changed && steps < MAX_MINIMIZE_STEPS;) {
+    changed = false;
+    for (i32 k = ff.blocks.size() - 1; k >= 0 && ff.blocks.size() > 1; k--) {
+      changed |= keep(remove_block(ff, k));
+    }
+    for (i32 k = 0; k < ff.blocks.size(); k++) {
+      for (i32 len = ff.blocks[k].insts.size() / 2; len >= 1; len /= 2) {
+        for (i32 at = 0; at + len <= ff.blocks[k].insts.size();) {
+          FuzzFunc c = ff;
+          auto &insts = c.blocks[k].insts;
+          insts.erase(insts.begin() + at, insts.begin() + at + len);
+          if (keep(c)) {
+            changed = true;
+          } else {
+            at += len;
+          }
+        }
+      }
+    }
+    for (i32 k = 0; k < ff.blocks.size(); k++) {
+      if (ff.blocks[k].target != -1) {
+        FuzzFunc c = ff;
+        c.blocks[k].target = -1;
+        changed |= keep(c);
+      }
+    }
+  }
+  steps = 0;
+  keep(compact_vregs(ff));
+  return ff;
+}
+
+/********************************
+ * 搜索和 corpus
+ * 保留得分最高的 FUZZ_POPULATION 个函数，每次从中选一个变异。得分为 ms * rounds / insts，
+ * 即每条指令的分配耗时乘以 spill 轮数。得分超过历史最高 10% 时测量增长指数，
+ * 超线性的输入最小化之后按内容的 hash 命名写入 corpus，已有的不重复写入
+ */
+constexpr i32 FUZZ_POPULATION = 16;
+
+static double score(const AllocCost &c) { return c.ms * c.rounds / std::max(c.insts, 1); }
+
+static std::string describe(const Growth &g) {
+  return "insts^" + std::to_string(g.exponent) + ", " + std::to_string(g.largest.insts) + " insts, " +
+         std::to_string(g.largest.rounds) + " rounds, " + std::to_string(g.largest.ms) + " ms" +
+         (g.largest.fallback ? ", fell back to stack slots" : "");
+}
+
+static bool save_case(const std::string &dir, const FuzzFunc &ff, const Growth &g) {
+  auto text = serialize(ff);
+  char name[32];
+  std::snprintf(name, sizeof(name), "cliff-%016zx.txt", std::hash<std::string>()(text));
+  auto path = std::filesystem::path(dir) / name;
+  if (std::filesystem::exists(path)) {
+    return false;
+  }
+  std::ofstream os(path);
+  os << "# " << describe(g) << " at scale " << GROWTH_SCALES[std::size(GROWTH_SCALES) - 1] << "\n" << text;
+  std::cout << "saved " << path.string() << ": " << describe(g) << std::endl;
+  return true;
+}
+
+static i32 search(const std::string &dir, i32 iterations, u32 seed) {
+  Mutator m(seed);
+  std::vector<std::pair<double, FuzzFunc>> population;
+  for (i32 k = 0; k < FUZZ_POPULATION; k++) {
+    auto ff = m.random_func();
+    population.push_back({score(measure(ff)), ff});
+  }
+  double best = 0;
+  i32 found = 0;
+  for (i32 it = 0; it < iterations; it++) {
+    // 两个中选得分高的一个作为父代
+    auto &a = population[m.pick(population.size())], &b = population[m.pick(population.size())];
+    auto child = m.mutate(a.first > b.first ? a.second : b.second);
+    double s = score(measure(child));
+    auto worst = std::min_element(population.begin(), population.end(),
+                                  [](const auto &x, const auto &y) { return x.first < y.first; });
+    if (s > worst->first) {
+      *worst = {s, child};
+    }
+    if (s <= best * 1.1) {
+      continue;
+    }
+    best = s;
+    auto g = measure_growth(child);
+    std::cout << "iteration " << it << ": score " << s << ", " << describe(g) << std::endl;
+    if (superlinear(g)) {
+      auto small = minimize(child, g);
+      found += save_case(dir, small, g);
+    }
+  }
+  std::cout << found << " new inputs saved to " << dir << std::endl;
+  return 0;
+}
+
+static i32 replay(const std::string &dir) {
+  i32 failed = 0;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    if (entry.path().extension() != ".txt") {
+      continue;
+    }
+    std::ifstream is(entry.path());
+    FuzzFunc ff;
+    if (!parse(is, ff) || !reducible(ff)) {
+      std::cout << entry.path().string() << ": malformed" << std::endl;
+      failed++;
+      continue;
+    }
+    auto g = measure_growth(ff);
+    bool bad = superlinear(g);
+    failed += bad;
+    std::cout << entry.path().string() << ": " << describe(g) << (bad ? ", still super-linear" : "") << std::endl;
+  }
+  return failed != 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 3 && std::string(argv[1]) == "--replay") {
+    return replay(argv[2]);
+  }
+  if (argc < 2 || argv[1][0] == '-') {
+    std::cerr << "usage: " << argv[0] << " <corpus dir> [iterations] [seed]\n"
+              << "       " << argv[0] << " --replay <corpus dir>" << std::endl;
+    return 2;
+  }
+  std::filesystem::create_directories(argv[1]);
+  i32 iterations = argc > 2 ? std::atoi(argv[2]) : 1000;
+  u32 seed = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : std::random_device()();
+  return search(argv[1], iterations, seed);
+}
+
+#endif
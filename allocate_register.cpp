@@ -1,12 +1,39 @@
 #include "allocate_register.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
+#include <thread>
+#include <tuple>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "../ir/cfg.hpp"
+#include "alloc_cost.hpp"
+#include "block_frequency.hpp"
+#include "machine_edge.hpp"
+#include "phase_memory.hpp"
+#include "physical_liveness.hpp"
+#include "register_hint.hpp"
+#include "register_pressure.hpp"
+#include "stats_json.hpp"
 
 /********************************
  * 寄存器分配文件，请修改此文件完成寄存器分配工作
@@ -30,11 +57,22 @@ std::pair<std::vector<MachineOperand>, std::vector<MachineOperand>> get_def_use(
   } else if (auto x = dyn_cast<MIMove>(inst)) {
     def = {x->dst};
     use = {x->rhs};
+    // 条件执行的 mov 不一定写入 dst，原来的值仍然活跃
+    if (x->cond != ArmCond::Any) {
+      use.push_back(x->dst);
+    }
   } else if (auto x = dyn_cast<MILoad>(inst)) {
     def = {x->dst};
     use = {x->addr, x->offset};
+    // 前变址和后变址会写回 addr
+    if (x->mode != MIAccess::Mode::Offset) {
+      def.push_back(x->addr);
+    }
   } else if (auto x = dyn_cast<MIStore>(inst)) {
     use = {x->data, x->addr, x->offset};
+    if (x->mode != MIAccess::Mode::Offset) {
+      def.push_back(x->addr);
+    }
   } else if (auto x = dyn_cast<MICompare>(inst)) {
     use = {x->lhs, x->rhs};
   } else if (auto x = dyn_cast<MICall>(inst)) {
@@ -42,129 +80,4065 @@ std::pair<std::vector<MachineOperand>, std::vector<MachineOperand>> get_def_use(
     for (u32 i = (u32)ArmReg::r0; i < (u32)ArmReg::r0 + std::min(x->func->params.size(), (size_t)4); ++i) {
       use.push_back(MachineOperand::R((ArmReg)i));
     }
-    for (u32 i = (u32)ArmReg::r0; i <= (u32)ArmReg::r3; i++) {
-      def.push_back(MachineOperand::R((ArmReg)i));
+    for (u32 i = (u32)ArmReg::r0; i <= (u32)ArmReg::r3; i++) {
+      def.push_back(MachineOperand::R((ArmReg)i));
+    }
+    def.push_back(MachineOperand::R(ArmReg::lr));
+    def.push_back(MachineOperand::R(ArmReg::ip));
+  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
+    def = {x->dst};
+  } else if (isa<MIReturn>(inst)) {
+    // ret
+    use.push_back(MachineOperand::R(ArmReg::r0));
+  }
+  return {def, use};
+}
+
+// 返回一条机器指令需要使用和修改的寄存器的地址，一条指令可以修改多个寄存器
+std::pair<std::vector<MachineOperand *>, std::vector<MachineOperand *>> get_defs_use_ptr(MachineInst *inst) {
+  std::vector<MachineOperand *> def;
+  std::vector<MachineOperand *> use;
+
+  if (auto x = dyn_cast<MIBinary>(inst)) {
+    def = {&x->dst};
+    use = {&x->lhs, &x->rhs};
+  } else if (auto x = dyn_cast<MILongMul>(inst)) {
+    def = {&x->dst};
+    use = {&x->lhs, &x->rhs};
+  } else if (auto x = dyn_cast<MIFma>(inst)) {
+    def = {&x->dst};
+    use = {&x->dst, &x->lhs, &x->rhs, &x->acc};
+  } else if (auto x = dyn_cast<MIMove>(inst)) {
+    def = {&x->dst};
+    use = {&x->rhs};
+    if (x->cond != ArmCond::Any) {
+      use.push_back(&x->dst);
+    }
+  } else if (auto x = dyn_cast<MILoad>(inst)) {
+    def = {&x->dst};
+    use = {&x->addr, &x->offset};
+    if (x->mode != MIAccess::Mode::Offset) {
+      def.push_back(&x->addr);
+    }
+  } else if (auto x = dyn_cast<MIStore>(inst)) {
+    use = {&x->data, &x->addr, &x->offset};
+    if (x->mode != MIAccess::Mode::Offset) {
+      def.push_back(&x->addr);
+    }
+  } else if (auto x = dyn_cast<MICompare>(inst)) {
+    use = {&x->lhs, &x->rhs};
+  } else if (isa<MICall>(inst)) {
+    // intentionally blank
+  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
+    def = {&x->dst};
+  }
+  return {def, use};
+}
+
+// 只返回第一个 def，给只处理单个 def 的调用者使用
+std::pair<MachineOperand *, std::vector<MachineOperand *>> get_def_use_ptr(MachineInst *inst) {
+  auto [def, use] = get_defs_use_ptr(inst);
+  return {def.empty() ? nullptr : def[0], use};
+}
+
+/********************************
+ * 分析live-range
+ * 块数足够多时并行：各块的 liveuse / def 互不相关，直接分给多个线程；
+ * 不动点按 CFG 的强连通分量求解，一个分量的所有后继分量都求解完之后才能开始，互不依赖的分量并行。
+ * 数据流方程的最小不动点是唯一的，结果与顺序求解完全相同，debug 构建中会与顺序求解的结果对照。
+ * 线程池由 allocate_register 为每个函数创建，活跃分析和 trace 局部分配复用，分配完这个函数后随作用域销毁；
+ * 其他调用者的 liveness_analysis(f) 只在这一次调用中使用线程池
+ */
+constexpr int PARALLEL_LIVENESS_MIN_BLOCKS = 512;
+constexpr size_t MAX_WORKER_THREADS = 8;
+
+static void local_liveness(MachineBB *bb) {
+  bb->liveuse.clear();
+  bb->def.clear();
+  for (auto inst = bb->insts.head; inst; inst = inst->next) {
+    auto [def, use] = get_def_use(inst);
+
+    // liveuse
+    for (auto &u : use) {
+      if (u.needs_color() && bb->def.find(u) == bb->def.end()) {
+        bb->liveuse.insert(u);
+      }
+    }
+    // def
+    for (auto &d : def) {
+      if (d.needs_color() && bb->liveuse.find(d) == bb->liveuse.end()) {
+        bb->def.insert(d);
+      }
+    }
+  }
+  // initial values
+  bb->livein = bb->liveuse;
+  bb->liveout.clear();
+}
+
+// 在 blocks 上迭代到不动点，blocks 之外的后继的 livein 已经是最终结果
+static void solve_liveness(const std::vector<MachineBB *> &blocks) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto bb : blocks) {
+      std::set<MachineOperand> new_out;
+      for (auto &succ : bb->succ) {
+        if (succ) {
+          new_out.insert(succ->livein.begin(), succ->livein.end());
+        }
+      }
+
+      if (new_out != bb->liveout) {
+        changed = true;
+        bb->liveout = new_out;
+        std::set<MachineOperand> new_in = bb->liveuse;
+        for (auto &e : bb->liveout) {
+          if (bb->def.find(e) == bb->def.end()) {
+            new_in.insert(e);
+          }
+        }
+
+        bb->livein = new_in;
+      }
+    }
+  }
+}
+
+// Tarjan 算法，分量按逆拓扑序给出：每个分量的后继分量都在它之前
+static std::vector<std::vector<MachineBB *>> strongly_connected(const std::vector<MachineBB *> &bbs) {
+  std::vector<std::vector<MachineBB *>> sccs;
+  std::map<MachineBB *, i32> index, low;
+  std::vector<MachineBB *> stack;
+  std::set<MachineBB *> on_stack;
+  i32 counter = 0;
+  auto visit = [&](MachineBB *bb) {
+    index[bb] = low[bb] = counter++;
+    stack.push_back(bb);
+    on_stack.insert(bb);
+  };
+  for (auto root : bbs) {
+    if (index.count(root)) {
+      continue;
+    }
+    visit(root);
+    std::vector<std::pair<MachineBB *, i32>> call = {{root, 0}};
+    while (!call.empty()) {
+      auto [bb, i] = call.back();
+      if (i < 2) {
+        call.back().second++;
+        auto succ = bb->succ[i];
+        if (succ == nullptr) {
+          continue;
+        }
+        if (!index.count(succ)) {
+          visit(succ);
+          call.push_back({succ, 0});
+        } else if (on_stack.count(succ)) {
+          low[bb] = std::min(low[bb], index[succ]);
+        }
+        continue;
+      }
+      call.pop_back();
+      if (!call.empty()) {
+        auto parent = call.back().first;
+        low[parent] = std::min(low[parent], low[bb]);
+      }
+      if (low[bb] == index[bb]) {
+        sccs.emplace_back();
+        MachineBB *x;
+        do {
+          x = stack.back();
+          stack.pop_back();
+          on_stack.erase(x);
+          sccs.back().push_back(x);
+        } while (x != bb);
+      }
+    }
+  }
+  return sccs;
+}
+
+// run(phase, job) 在每个线程上执行一次 job，分配的内存记到 phase，全部返回之后 run 才返回
+struct WorkerPool {
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  const std::function<void()> *job = nullptr;
+  Phase phase = Phase::Other;
+  size_t running = 0;
+  u64 generation = 0;
+  bool stopping = false;
+
+  explicit WorkerPool(size_t threads) {
+    for (size_t t = 0; t < threads; t++) {
+      workers.emplace_back([this]() { loop(); });
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : workers) {
+      t.join();
+    }
+  }
+
+  void run(Phase p, const std::function<void()> &f) {
+    std::unique_lock<std::mutex> lock(mutex);
+    job = &f;
+    phase = p;
+    running = workers.size();
+    generation++;
+    wake.notify_all();
+    done.wait(lock, [&]() { return running == 0; });
+    job = nullptr;
+  }
+
+  void loop() {
+    u64 seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [&]() { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+      auto f = job;
+      auto p = phase;
+      lock.unlock();
+      {
+        MemoryPhase scope(p);
+        (*f)();
+      }
+      lock.lock();
+      if (--running == 0) {
+        done.notify_one();
+      }
+    }
+  }
+};
+
+static size_t worker_threads() { return std::min<size_t>(std::thread::hardware_concurrency(), MAX_WORKER_THREADS); }
+
+static void parallel_liveness(const std::vector<MachineBB *> &bbs, WorkerPool &pool) {
+  std::atomic<size_t> cursor(0);
+  pool.run(Phase::Liveness, [&]() {
+    for (size_t k; (k = cursor++) < bbs.size();) {
+      local_liveness(bbs[k]);
+    }
+  });
+
+  auto sccs = strongly_connected(bbs);
+  std::map<MachineBB *, i32> scc_of;
+  for (i32 c = 0; c < sccs.size(); c++) {
+    for (auto bb : sccs[c]) {
+      scc_of[bb] = c;
+    }
+  }
+  // pending[c] 为 c 还没有求解完的后继分量数，preds[c] 为以 c 为后继的分量
+  std::vector<i32> pending(sccs.size());
+  std::vector<std::vector<i32>> preds(sccs.size());
+  std::vector<i32> ready;
+  for (i32 c = 0; c < sccs.size(); c++) {
+    std::set<i32> succs;
+    for (auto bb : sccs[c]) {
+      for (auto succ : bb->succ) {
+        if (succ && scc_of[succ] != c) {
+          succs.insert(scc_of[succ]);
+        }
+      }
+    }
+    pending[c] = succs.size();
+    for (i32 s : succs) {
+      preds[s].push_back(c);
+    }
+    if (succs.empty()) {
+      ready.push_back(c);
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t finished = 0;
+  pool.run(Phase::Liveness, [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&]() { return !ready.empty() || finished == sccs.size(); });
+      if (finished == sccs.size()) {
+        return;
+      }
+      i32 c = ready.back();
+      ready.pop_back();
+      lock.unlock();
+      solve_liveness(sccs[c]);
+      lock.lock();
+      finished++;
+      for (i32 p : preds[c]) {
+        if (--pending[p] == 0) {
+          ready.push_back(p);
+        }
+      }
+      cv.notify_all();
+    }
+  });
+}
+
+#ifndef NDEBUG
+// 并行求解的结果与顺序求解对照
+static void check_liveness(const std::vector<MachineBB *> &bbs) {
+  std::vector<std::pair<std::set<MachineOperand>, std::set<MachineOperand>>> parallel;
+  for (auto bb : bbs) {
+    parallel.push_back({bb->livein, bb->liveout});
+  }
+  for (auto bb : bbs) {
+    local_liveness(bb);
+  }
+  solve_liveness(bbs);
+  for (size_t k = 0; k < bbs.size(); k++) {
+    assert(parallel[k].first == bbs[k]->livein && parallel[k].second == bbs[k]->liveout);
+  }
+}
+#endif
+
+// pool 为空或块数不够多时顺序求解
+static void liveness_analysis(MachineFunc *f, WorkerPool *pool) {
+  MemoryPhase phase(Phase::Liveness);
+  std::vector<MachineBB *> bbs;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    bbs.push_back(bb);
+  }
+  if (pool && bbs.size() >= PARALLEL_LIVENESS_MIN_BLOCKS) {
+    parallel_liveness(bbs, *pool);
+  #ifndef NDEBUG
+    check_liveness(bbs);
+  #endif
+    return;
+  }
+  // calculate LiveUse and Def sets for each bb
+  // each elements is a virtual register or precolored register
+  for (auto bb : bbs) {
+    local_liveness(bb);
+  }
+  // calculate LiveIn and LiveOut for each bb
+  solve_liveness(bbs);
+}
+
+void liveness_analysis(MachineFunc *f) {
+  i32 blocks = 0;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    blocks++;
+  }
+  std::unique_ptr<WorkerPool> pool;
+  if (blocks >= PARALLEL_LIVENESS_MIN_BLOCKS && worker_threads() >= 2) {
+    pool = std::make_unique<WorkerPool>(worker_threads());
+  }
+  liveness_analysis(f, pool.get());
+}
+
+/********************************
+ * 机器级 CFG 分析：前驱、支配树、循环嵌套森林
+ * 由 MachineBB::succ 计算，不依赖 IR，机器级的 CFG 变换之后仍然有效。
+ * 每个 MachineFunc 缓存一份，在边上插入新块时增量更新，其他的 CFG 修改之后需要 invalidate
+ */
+struct MachineLoop {
+  MachineBB *header;
+  MachineLoop *parent = nullptr;
+  i32 depth = 1;
+  std::set<MachineBB *> blocks;
+};
+
+struct MachineCFG {
+  std::vector<MachineBB *> rpo;  // 可达块的逆后序
+  std::map<MachineBB *, std::vector<MachineBB *>> preds;
+  std::map<MachineBB *, MachineBB *> idom;  // 入口的 idom 为 nullptr
+  std::map<MachineBB *, MachineLoop *> loop_of;  // 所在的最内层循环
+  std::vector<std::unique_ptr<MachineLoop>> loops;
+  std::map<MachineBB *, double> freq;  // 块频率，入口为 1
+  std::map<std::pair<MachineBB *, MachineBB *>, double> prob;  // 边的概率
+
+  double frequency(MachineBB *bb) const {
+    auto it = freq.find(bb);
+    return it == freq.end() ? 0 : it->second;
+  }
+
+  double probability(MachineBB *from, MachineBB *to) const {
+    auto it = prob.find({from, to});
+    return it == prob.end() ? 0 : it->second;
+  }
+
+  i32 depth(MachineBB *bb) const {
+    auto it = loop_of.find(bb);
+    return it == loop_of.end() ? 0 : it->second->depth;
+  }
+
+  bool dominates(MachineBB *a, MachineBB *b) const {
+    for (; b != nullptr; b = idom.at(b)) {
+      if (a == b) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // 同时包含 a 和 b 的最内层循环
+  MachineLoop *common_loop(MachineBB *a, MachineBB *b) const {
+    auto it = loop_of.find(a);
+    for (MachineLoop *l = it == loop_of.end() ? nullptr : it->second; l; l = l->parent) {
+      if (l->blocks.count(b)) {
+        return l;
+      }
+    }
+    return nullptr;
+  }
+
+  // 新块 bb 插在边 pred -> succ 上
+  void insert_on_edge(MachineBB *bb, MachineBB *pred, MachineBB *succ) {
+    preds[bb] = {pred};
+    std::replace(preds[succ].begin(), preds[succ].end(), pred, bb);
+    idom[bb] = pred;
+    if (preds[succ].size() == 1) {
+      idom[succ] = bb;
+    }
+    // bb 紧跟在唯一的前驱之后；不能放在 succ 之前，回边上 succ 排在 pred 前面
+    rpo.insert(std::find(rpo.begin(), rpo.end(), pred) + 1, bb);
+    prob[{pred, bb}] = probability(pred, succ);
+    prob[{bb, succ}] = 1;
+    prob.erase({pred, succ});
+    freq[bb] = frequency(pred) * prob[{pred, bb}];
+    if (auto l = common_loop(pred, succ)) {
+      loop_of[bb] = l;
+      for (; l; l = l->parent) {
+        l->blocks.insert(bb);
+      }
+    }
+  }
+};
+
+static void compute_machine_cfg(MachineFunc *f, MachineCFG &cfg) {
+  // 逆后序
+  std::set<MachineBB *> visited{f->bb.head};
+  std::vector<std::pair<MachineBB *, i32>> stack{{f->bb.head, 0}};
+  while (!stack.empty()) {
+    auto &[bb, k] = stack.back();
+    if (k == 2) {
+      cfg.rpo.push_back(bb);
+      stack.pop_back();
+      continue;
+    }
+    auto s = bb->succ[k++];
+    if (s != nullptr && visited.insert(s).second) {
+      stack.push_back({s, 0});
+    }
+  }
+  std::reverse(cfg.rpo.begin(), cfg.rpo.end());
+  std::map<MachineBB *, i32> order;
+  for (i32 i = 0; i < cfg.rpo.size(); i++) {
+    order[cfg.rpo[i]] = i;
+  }
+  for (auto bb : cfg.rpo) {
+    cfg.preds[bb];
+    for (i32 k = 0; k < 2; k++) {
+      auto s = bb->succ[k];
+      if (s != nullptr && !(k == 1 && s == bb->succ[0])) {
+        cfg.preds[s].push_back(bb);
+      }
+    }
+  }
+
+  // Cooper, Harvey, Kennedy: A Simple, Fast Dominance Algorithm
+  auto intersect = [&](MachineBB *a, MachineBB *b) {
+    while (a != b) {
+      while (order[a] > order[b]) {
+        a = cfg.idom[a];
+      }
+      while (order[b] > order[a]) {
+        b = cfg.idom[b];
+      }
+    }
+    return a;
+  };
+  cfg.idom[f->bb.head] = f->bb.head;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto bb : cfg.rpo) {
+      if (bb == f->bb.head) {
+        continue;
+      }
+      MachineBB *new_idom = nullptr;
+      for (auto p : cfg.preds[bb]) {
+        if (cfg.idom.count(p)) {
+          new_idom = new_idom == nullptr ? p : intersect(p, new_idom);
+        }
+      }
+      if (cfg.idom[bb] != new_idom) {
+        cfg.idom[bb] = new_idom;
+        changed = true;
+      }
+    }
+  }
+  cfg.idom[f->bb.head] = nullptr;
+
+  // 自然循环：回边 n -> h（h 支配 n），同一个 header 的合并为一个循环
+  std::map<MachineBB *, MachineLoop *> by_header;
+  for (auto n : cfg.rpo) {
+    for (auto h : n->succ) {
+      if (h == nullptr || !cfg.dominates(h, n)) {
+        continue;
+      }
+      auto &l = by_header[h];
+      if (l == nullptr) {
+        cfg.loops.push_back(std::make_unique<MachineLoop>());
+        l = cfg.loops.back().get();
+        l->header = h;
+        l->blocks.insert(h);
+      }
+      std::vector<MachineBB *> work;
+      if (l->blocks.insert(n).second) {
+        work.push_back(n);
+      }
+      while (!work.empty()) {
+        auto bb = work.back();
+        work.pop_back();
+        for (auto p : cfg.preds[bb]) {
+          if (l->blocks.insert(p).second) {
+            work.push_back(p);
+          }
+        }
+      }
+    }
+  }
+  // 父循环为包含自己 header 的最小的其他循环；按从大到小处理，父循环的深度已经确定
+  std::vector<MachineLoop *> sorted;
+  for (auto &l : cfg.loops) {
+    sorted.push_back(l.get());
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](MachineLoop *a, MachineLoop *b) { return a->blocks.size() > b->blocks.size(); });
+  for (i32 i = 0; i < sorted.size(); i++) {
+    for (i32 j = i - 1; j >= 0; j--) {
+      if (sorted[j]->blocks.count(sorted[i]->header)) {
+        sorted[i]->parent = sorted[j];
+        sorted[i]->depth = sorted[j]->depth + 1;
+        break;
+      }
+    }
+    for (auto bb : sorted[i]->blocks) {
+      cfg.loop_of[bb] = sorted[i];
+    }
+  }
+}
+
+/********************************
+ * 静态分支概率和块频率 (Wu & Larus)
+ * 分支概率由几条启发式规则用 Dempster-Shafer 合并：回边、循环出口、相等比较、避开 call。
+ * 块频率从最内层循环向外传播：先算出每个循环 header 的回边概率之和 (cyclic probability)，
+ * 外层传播时 header 的频率除以 1 - cyclic probability
+ */
+constexpr double PROB_BACK_EDGE = 0.88;
+constexpr double PROB_LOOP_EXIT = 0.2;
+constexpr double PROB_EQUAL_TAKEN = 0.375;
+constexpr double PROB_CALL = 0.22;
+constexpr double MAX_CYCLIC_PROB = 0.999;
+
+// 判断 b -> s 是否为回边
+static bool is_back_edge(const MachineCFG &cfg, MachineBB *b, MachineBB *s) { return cfg.dominates(s, b); }
+
+static bool has_call(MachineBB *bb) {
+  for (auto inst = bb->insts.head; inst; inst = inst->next) {
+    if (isa<MICall>(inst)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 返回 bb -> a 的概率（另一个后继为 b）
+static double branch_probability(const MachineCFG &cfg, MachineBB *bb, MachineBB *a, MachineBB *b) {
+  double p = 0.5;
+  auto combine = [&](double q) { p = p * q / (p * q + (1 - p) * (1 - q)); };
+  bool back_a = is_back_edge(cfg, bb, a), back_b = is_back_edge(cfg, bb, b);
+  if (back_a != back_b) {
+    combine(back_a ? PROB_BACK_EDGE : 1 - PROB_BACK_EDGE);
+  }
+  auto loop = cfg.loop_of.find(bb);
+  if (loop != cfg.loop_of.end()) {
+    bool exit_a = !loop->second->blocks.count(a), exit_b = !loop->second->blocks.count(b);
+    if (exit_a != exit_b) {
+      combine(exit_a ? PROB_LOOP_EXIT : 1 - PROB_LOOP_EXIT);
+    }
+  }
+  auto last = bb->insts.tail;
+  if (last && isa<MIJump>(last)) {
+    last = last->prev;
+  }
+  auto br = last ? dyn_cast<MIBranch>(last) : nullptr;
+  if (br != nullptr && (br->cond == ArmCond::Eq || br->cond == ArmCond::Ne)) {
+    double taken = br->cond == ArmCond::Eq ? PROB_EQUAL_TAKEN : 1 - PROB_EQUAL_TAKEN;
+    combine(br->target == a ? taken : 1 - taken);
+  }
+  // 含 call 的后继不大可能执行，除非另一个后继也会走到它
+  bool call_a = has_call(a) && b->succ[0] != a && b->succ[1] != a;
+  bool call_b = has_call(b) && a->succ[0] != b && a->succ[1] != b;
+  if (call_a != call_b) {
+    combine(call_a ? PROB_CALL : 1 - PROB_CALL);
+  }
+  return p;
+}
+
+static void compute_block_frequency(MachineFunc *f, MachineCFG &cfg) {
+  for (auto bb : cfg.rpo) {
+    auto a = bb->succ[0], b = bb->succ[1];
+    if (a != nullptr && b != nullptr && a != b) {
+      double p = branch_probability(cfg, bb, a, b);
+      cfg.prob[{bb, a}] = p;
+      cfg.prob[{bb, b}] = 1 - p;
+    } else if (a != nullptr || b != nullptr) {
+      cfg.prob[{bb, a ? a : b}] = 1;
+    }
+  }
+
+  std::map<MachineBB *, double> cyclic;
+  // 在 region 中从 head 出发按逆后序传播，head 的频率为 1
+  auto propagate = [&](MachineBB *head, const std::set<MachineBB *> *region) {
+    std::map<MachineBB *, double> local;
+    for (auto bb : cfg.rpo) {
+      if (region && !region->count(bb)) {
+        continue;
+      }
+      double in = 0;
+      if (bb == head) {
+        in = 1;
+      } else {
+        for (auto p : cfg.preds.at(bb)) {
+          if ((!region || region->count(p)) && !is_back_edge(cfg, p, bb)) {
+            in += local[p] * cfg.probability(p, bb);
+          }
+        }
+        auto c = cyclic.find(bb);
+        if (c != cyclic.end()) {
+          in /= 1 - c->second;
+        }
+      }
+      local[bb] = in;
+    }
+    return local;
+  };
+  std::vector<MachineLoop *> inner_first;
+  for (auto &l : cfg.loops) {
+    inner_first.push_back(l.get());
+  }
+  std::stable_sort(inner_first.begin(), inner_first.end(),
+                   [](MachineLoop *a, MachineLoop *b) { return a->depth > b->depth; });
+  for (auto l : inner_first) {
+    auto local = propagate(l->header, &l->blocks);
+    double c = 0;
+    for (auto p : cfg.preds.at(l->header)) {
+      if (l->blocks.count(p) && is_back_edge(cfg, p, l->header)) {
+        c += local[p] * cfg.probability(p, l->header);
+      }
+    }
+    cyclic[l->header] = std::min(c, MAX_CYCLIC_PROB);
+  }
+  cfg.freq = propagate(f->bb.head, nullptr);
+  auto c = cyclic.find(f->bb.head);
+  if (c != cyclic.end()) {
+    cfg.freq[f->bb.head] /= 1 - c->second;
+  }
+}
+
+static std::map<MachineFunc *, std::unique_ptr<MachineCFG>> machine_cfg_cache;
+
+static MachineCFG &machine_cfg(MachineFunc *f) {
+  auto &cfg = machine_cfg_cache[f];
+  if (cfg == nullptr) {
+    cfg = std::make_unique<MachineCFG>();
+    compute_machine_cfg(f, *cfg);
+    compute_block_frequency(f, *cfg);
+  }
+  return *cfg;
+}
+
+static void invalidate_machine_cfg(MachineFunc *f) { machine_cfg_cache.erase(f); }
+
+double block_frequency(MachineFunc *f, MachineBB *bb) { return machine_cfg(f).frequency(bb); }
+
+void dump_block_frequency(MachineFunc *f, std::ostream &os) {
+  auto &cfg = machine_cfg(f);
+  std::map<MachineBB *, i32> index;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    index.insert({bb, (i32)index.size()});
+  }
+  os << "block frequency of " << f->func->func->name << std::endl;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    os << "  bb" << index[bb] << ": freq " << cfg.frequency(bb) << ", depth " << cfg.depth(bb);
+    for (auto s : bb->succ) {
+      if (s != nullptr) {
+        os << ", -> bb" << index[s] << " " << cfg.probability(bb, s);
+      }
+    }
+    os << std::endl;
+  }
+}
+
+#define MY_ALLOCATED_ALGORITHM
+// 按循环区域分配：内层循环中用到的区间先分配，被溢出的区间先在压力大的循环边界上拆分
+#define LOOP_REGION_ALLOCATION
+// 分配前输出每个函数的块频率和分支概率
+// #define DUMP_BLOCK_FREQUENCY
+
+// 线性扫描可以分配的寄存器为 r4 ~ r12
+constexpr i32 ALLOCATABLE_BEGIN = 4;
+constexpr i32 ALLOCATABLE_END = 13;
+// 区间分配的循环中每处理这么多个区间检查一次时间预算
+constexpr u32 BUDGET_CHECK_MASK = 1023;
+
+static bool over_budget(u32 &counter, std::chrono::steady_clock::time_point deadline) {
+  return (++counter & BUDGET_CHECK_MASK) == 0 && std::chrono::steady_clock::now() > deadline;
+}
+
+/********************************
+ * live interval 以 SoA 形式存放：starts/ends/reg 各自连续，
+ * 冲突检查时可以一次比较 4 个 (SSE2) 或 8 个 (AVX2) 区间
+ */
+struct IntervalSoA {
+  std::vector<i32> starts;
+  std::vector<i32> ends;
+  std::vector<i32> reg;
+
+  size_t size() const { return starts.size(); }
+
+  void push(i32 s, i32 e, i32 r) {
+    starts.push_back(s);
+    ends.push_back(e);
+    reg.push_back(r);
+  }
+
+  void clear() {
+    starts.clear();
+    ends.clear();
+    reg.clear();
+  }
+};
+
+// 返回与 [s, e] 有重叠的区间所占用的寄存器位图
+static u32 busy_mask(const IntervalSoA &iv, i32 s, i32 e) {
+  const i32 *st = iv.starts.data();
+  const i32 *en = iv.ends.data();
+  const i32 *rg = iv.reg.data();
+  size_t n = iv.size(), i = 0;
+  u32 mask = 0;
+#if defined(__AVX2__)
+  __m256i vs = _mm256_set1_epi32(s);
+  __m256i ve = _mm256_set1_epi32(e);
+  for (; i + 8 <= n; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(st + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(en + i));
+    // 不相交 <=> start > e || end < s
+    __m256i miss = _mm256_or_si256(_mm256_cmpgt_epi32(a, ve), _mm256_cmpgt_epi32(vs, b));
+    u32 hit = ~(u32)_mm256_movemask_ps(_mm256_castsi256_ps(miss)) & 0xffu;
+    for (; hit; hit &= hit - 1) {
+      mask |= 1u << rg[i + __builtin_ctz(hit)];
+    }
+  }
+#elif defined(__SSE2__)
+  __m128i vs = _mm_set1_epi32(s);
+  __m128i ve = _mm_set1_epi32(e);
+  for (; i + 4 <= n; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(st + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(en + i));
+    __m128i miss = _mm_or_si128(_mm_cmpgt_epi32(a, ve), _mm_cmplt_epi32(b, vs));
+    u32 hit = ~(u32)_mm_movemask_ps(_mm_castsi128_ps(miss)) & 0xfu;
+    for (; hit; hit &= hit - 1) {
+      mask |= 1u << rg[i + __builtin_ctz(hit)];
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    if (st[i] <= e && en[i] >= s) {
+      mask |= 1u << rg[i];
+    }
+  }
+  return mask;
+}
+
+#ifndef LOOP_REGION_ALLOCATION
+// 删除 end < pos 的区间，ids 与 iv 同步压缩
+static void expire_intervals(IntervalSoA &iv, std::vector<i32> &ids, i32 pos) {
+  size_t k = 0;
+  for (size_t i = 0; i < iv.size(); i++) {
+    if (iv.ends[i] >= pos) {
+      iv.starts[k] = iv.starts[i];
+      iv.ends[k] = iv.ends[i];
+      iv.reg[k] = iv.reg[i];
+      ids[k] = ids[i];
+      k++;
+    }
+  }
+  iv.starts.resize(k);
+  iv.ends.resize(k);
+  iv.reg.resize(k);
+  ids.resize(k);
+}
+#endif
+
+static i32 first_free_reg(u32 busy) {
+  for (i32 r = ALLOCATABLE_BEGIN; r < ALLOCATABLE_END; r++) {
+    if (!(busy >> r & 1u)) {
+      return r;
+    }
+  }
+  return -1;
+}
+
+static bool is_physical(const MachineOperand &o) {
+  return o.state == MachineOperand::State::PreColored || o.state == MachineOperand::State::Allocated;
+}
+
+/********************************
+ * 物理寄存器活跃分析
+ * 分配之后的变换用，寄存器集合用 16 位掩码表示，def / use 的规则与 get_def_use 相同
+ */
+static RegMask operand_mask(const std::vector<MachineOperand> &ops) {
+  RegMask mask = 0;
+  for (auto &o : ops) {
+    if (is_physical(o) && o.value < 16) {
+      mask |= 1u << o.value;
+    }
+  }
+  return mask;
+}
+
+RegMask step_liveness(MachineInst *inst, RegMask live) {
+  auto [def, use] = get_def_use(inst);
+  return (live & ~operand_mask(def)) | operand_mask(use);
+}
+
+void physical_liveness(MachineFunc *f, PhysicalLiveness &live) {
+  // 块内向前一遍得到 gen（块内先读后写的）和 kill（块内写过的）
+  std::map<MachineBB *, std::pair<RegMask, RegMask>> gen_kill;
+  std::vector<MachineBB *> order;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    RegMask gen = 0, kill = 0;
+    for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
+      auto [def, use] = get_def_use(inst);
+      RegMask d = operand_mask(def);
+      gen = (gen & ~d) | operand_mask(use);
+      kill |= d;
+    }
+    gen_kill[bb] = {gen, kill};
+    order.push_back(bb);
+  }
+  live.livein.clear();
+  live.liveout.clear();
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto it = order.rbegin(); it != order.rend(); it++) {
+      auto bb = *it;
+      RegMask out = 0;
+      for (auto succ : bb->succ) {
+        if (succ) {
+          out |= live.livein[succ];
+        }
+      }
+      auto [gen, kill] = gen_kill[bb];
+      RegMask in = gen | (out & ~kill);
+      if (in != live.livein[bb] || out != live.liveout[bb]) {
+        live.livein[bb] = in;
+        live.liveout[bb] = out;
+        changed = true;
+      }
+    }
+  }
+}
+
+/********************************
+ * 寄存器压力
+ * 每个块从 liveout 向前逐条指令计算同时活跃的 vreg 和 r4 ~ r12 的数目，取最大值，
+ * 循环的 MaxLive 为它包含的块中的最大值。
+ * 活跃集合在局部求解，不改动 bb 上 liveness_analysis 的结果，分配前的变换可以随时调用
+ */
+static std::map<MachineBB *, std::set<MachineOperand>> pressure_liveout(MachineFunc *f) {
+  std::map<MachineBB *, std::set<MachineOperand>> liveuse, def, livein, liveout;
+  std::vector<MachineBB *> bbs;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    bbs.push_back(bb);
+    auto &u = liveuse[bb];
+    auto &d = def[bb];
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [defs, uses] = get_def_use(inst);
+      for (auto &o : uses) {
+        if (o.needs_color() && !d.count(o)) {
+          u.insert(o);
+        }
+      }
+      for (auto &o : defs) {
+        if (o.needs_color() && !u.count(o)) {
+          d.insert(o);
+        }
+      }
+    }
+    livein[bb] = u;
+  }
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto it = bbs.rbegin(); it != bbs.rend(); ++it) {
+      auto bb = *it;
+      std::set<MachineOperand> out;
+      for (auto succ : bb->succ) {
+        if (succ) {
+          out.insert(livein[succ].begin(), livein[succ].end());
+        }
+      }
+      if (out != liveout[bb]) {
+        changed = true;
+        auto &in = livein[bb];
+        for (auto &o : out) {
+          if (!def[bb].count(o)) {
+            in.insert(o);
+          }
+        }
+        liveout[bb] = std::move(out);
+      }
+    }
+  }
+  return liveout;
+}
+
+static std::map<MachineBB *, i32> block_max_live(MachineFunc *f) {
+  auto liveout = pressure_liveout(f);
+  auto counted = [](const MachineOperand &o) {
+    return o.state == MachineOperand::State::Virtual ||
+           (is_physical(o) && o.value >= ALLOCATABLE_BEGIN && o.value < ALLOCATABLE_END);
+  };
+  std::map<MachineBB *, i32> result;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    std::set<MachineOperand> live;
+    for (auto &o : liveout[bb]) {
+      if (counted(o)) {
+        live.insert(o);
+      }
+    }
+    i32 max = live.size();
+    for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
+      auto [def, use] = get_def_use(inst);
+      // 定值的那一刻 def 与之后活跃的值同时存在
+      i32 defs = 0;
+      for (auto &d : def) {
+        defs += counted(d) && !live.count(d);
+      }
+      max = std::max(max, (i32)live.size() + defs);
+      for (auto &d : def) {
+        live.erase(d);
+      }
+      for (auto &u : use) {
+        if (counted(u)) {
+          live.insert(u);
+        }
+      }
+      max = std::max(max, (i32)live.size());
+    }
+    result[bb] = max;
+  }
+  return result;
+}
+
+std::vector<LoopPressure> estimate_register_pressure(MachineFunc *f) {
+  auto &cfg = machine_cfg(f);
+  auto live = block_max_live(f);
+  std::vector<LoopPressure> result;
+  for (auto &l : cfg.loops) {
+    i32 max = 0;
+    for (auto bb : l->blocks) {
+      max = std::max(max, live[bb]);
+    }
+    result.push_back({l->header, l->depth, max});
+  }
+  return result;
+}
+
+int max_live(MachineFunc *f) {
+  i32 max = 0;
+  for (auto [bb, n] : block_max_live(f)) {
+    max = std::max(max, n);
+  }
+  return max;
+}
+
+// 每个循环中以 sp 为基址的 load / store 数目，分配前后相减即为分配在循环中加入的 spill 代码
+static std::map<MachineLoop *, i32> sp_accesses(const MachineCFG &cfg) {
+  std::map<MachineLoop *, i32> result;
+  for (auto &l : cfg.loops) {
+    i32 n = 0;
+    for (auto bb : l->blocks) {
+      for (auto inst = bb->insts.head; inst; inst = inst->next) {
+        if (auto x = dyn_cast<MIAccess>(inst)) {
+          n += x->addr == MachineOperand::R(ArmReg::sp);
+        }
+      }
+    }
+    result[l.get()] = n;
+  }
+  return result;
+}
+
+/********************************
+ * 寄存器偏好
+ * 前面的 pass 按 MachineFunc 登记，分配这个函数时整张表取出来作为它的状态（RegisterConstraints）传下去。
+ * 分配时按区间编号解析为 reg / same 两个数组，选择寄存器时偏好的寄存器空闲就直接使用；
+ * trace 局部分配和精确分配也参考偏好。只有 r4 ~ r12 可以分配，偏好 r0 ~ r3 的 hint 不起作用
+ */
+struct RegisterHint {
+  i32 reg = -1;   // 偏好的物理寄存器
+  i32 same = -1;  // 偏好与之相同的 vreg 编号
+};
+
+static std::map<MachineFunc *, std::map<MachineOperand, RegisterHint>> register_hints;
+
+void hint_register(MachineFunc *f, const MachineOperand &vreg, ArmReg reg) {
+  register_hints[f][vreg].reg = (i32)reg;
+}
+
+static void add_same_hint(std::map<MachineOperand, RegisterHint> &hints, const MachineOperand &vreg,
+                          const MachineOperand &other) {
+  hints[vreg].same = other.value;
+  if (hints[other].same == -1) {
+    hints[other].same = vreg.value;
+  }
+}
+
+void hint_same_register(MachineFunc *f, const MachineOperand &vreg, const MachineOperand &other) {
+  add_same_hint(register_hints[f], vreg, other);
+}
+
+// 一个函数的偏好：开始分配时从上面的全局表中取出，之后只通过参数传递
+struct RegisterConstraints {
+  std::map<MachineOperand, RegisterHint> hints;
+};
+
+static RegisterConstraints take_register_constraints(MachineFunc *f) {
+  RegisterConstraints c;
+  auto hints = register_hints.find(f);
+  if (hints != register_hints.end()) {
+    c.hints = std::move(hints->second);
+    register_hints.erase(hints);
+  }
+  return c;
+}
+
+// fma 的结果和累加值用同一个寄存器
+static void add_default_hints(MachineFunc *f, RegisterConstraints &c) {
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      if (auto x = dyn_cast<MIFma>(inst)) {
+        if (x->dst.state == MachineOperand::State::Virtual && x->acc.state == MachineOperand::State::Virtual &&
+            x->dst != x->acc && c.hints.count(x->dst) == 0) {
+          add_same_hint(c.hints, x->dst, x->acc);
+        }
+      }
+    }
+  }
+}
+
+struct IntervalHints {
+  std::vector<i32> reg;
+  std::vector<i32> same;  // 区间编号
+  i32 hit = 0;
+  i32 miss = 0;
+};
+
+static IntervalHints resolve_hints(const RegisterConstraints &c, const std::map<MachineOperand, i32> &interval_id) {
+  IntervalHints h;
+  h.reg.assign(interval_id.size(), -1);
+  h.same.assign(interval_id.size(), -1);
+  for (auto &[o, hint] : c.hints) {
+    auto id = interval_id.find(o);
+    if (id == interval_id.end()) {
+      continue;
+    }
+    if (hint.reg >= ALLOCATABLE_BEGIN && hint.reg < ALLOCATABLE_END) {
+      h.reg[id->second] = hint.reg;
+    }
+    if (hint.same != -1) {
+      auto other = interval_id.find(MachineOperand::V(hint.same));
+      if (other != interval_id.end()) {
+        h.same[id->second] = other->second;
+      }
+    }
+  }
+  return h;
+}
+
+// 偏好的寄存器空闲时使用它，否则使用第一个空闲寄存器
+static i32 hinted_free_reg(u32 busy, i32 id, const IntervalSoA &intervals, IntervalHints &h) {
+  i32 want = h.reg[id];
+  if (want == -1 && h.same[id] != -1) {
+    want = intervals.reg[h.same[id]];
+  }
+  if (want != -1) {
+    if (!(busy >> want & 1u)) {
+      h.hit++;
+      return want;
+    }
+    h.miss++;
+  }
+  return first_free_reg(busy);
+}
+
+/********************************
+ * 在线性化的指令序列上计算 live interval
+ * virtual register: 覆盖所有活跃点的一个区间 [start, end]，skip 中的 vreg 不参与
+ * r4 ~ r12 的 precolored 寄存器（例如 call 破坏的 ip）: 逐段记录为 fixed interval
+ */
+static void build_intervals(const std::vector<MachineBB *> &dfs, const std::vector<i32> &bb_begin,
+                            const std::set<MachineOperand> &skip, std::map<MachineOperand, i32> &interval_id,
+                            std::vector<MachineOperand> &interval_oper, IntervalSoA &intervals, IntervalSoA &fixed) {
+  MemoryPhase phase(Phase::Intervals);
+  auto touch = [&](const MachineOperand &o, i32 pos) {
+    auto [it, inserted] = interval_id.insert({o, (i32)interval_oper.size()});
+    if (inserted) {
+      interval_oper.push_back(o);
+      intervals.push(pos, pos, -1);
+    } else {
+      i32 id = it->second;
+      intervals.starts[id] = std::min(intervals.starts[id], pos);
+      intervals.ends[id] = std::max(intervals.ends[id], pos);
+    }
+  };
+  auto tracked = [&](const MachineOperand &o) {
+    return o.state == MachineOperand::State::Virtual && skip.find(o) == skip.end();
+  };
+  auto in_range = [](const MachineOperand &o) {
+    return is_physical(o) && o.value >= ALLOCATABLE_BEGIN && o.value < ALLOCATABLE_END;
+  };
+
+  for (size_t i = 0; i < dfs.size(); i++) {
+    auto bb = dfs[i];
+    i32 begin = bb_begin[i];
+    i32 pos = bb_begin[i + 1] - 1;
+    if (pos < begin) {
+      continue;
+    }
+    // live 中的元素在当前指令之后活跃
+    std::set<MachineOperand> live;
+    std::map<MachineOperand, i32> seg_end;
+    for (auto &o : bb->liveout) {
+      if (tracked(o)) {
+        live.insert(o);
+        touch(o, pos);
+      } else if (in_range(o)) {
+        seg_end[o] = pos;
+      }
+    }
+
+    for (auto inst = bb->insts.tail; inst; inst = inst->prev, pos--) {
+      auto [def, use] = get_def_use(inst);
+      for (auto &d : def) {
+        if (tracked(d)) {
+          touch(d, pos);
+          live.erase(d);
+        } else if (in_range(d)) {
+          auto it = seg_end.find(d);
+          fixed.push(pos, it == seg_end.end() ? pos : it->second, d.value);
+          if (it != seg_end.end()) {
+            seg_end.erase(it);
+          }
+        }
+      }
+      for (auto &u : use) {
+        if (tracked(u)) {
+          if (live.insert(u).second && pos > begin) {
+            touch(u, pos - 1);
+          }
+        } else if (in_range(u)) {
+          seg_end.insert({u, std::max(pos - 1, begin)});
+        }
+      }
+    }
+
+    // livein 的值即使只在第一条指令用到，也要在块首占住寄存器
+    for (auto &o : live) {
+      touch(o, begin);
+    }
+    for (auto &[o, e] : seg_end) {
+      fixed.push(begin, e, o.value);
+    }
+  }
+}
+
+/********************************
+ * 循环区域分配 (Callahan-Koblenz)
+ * 区间的区域为使用它的最内层循环。按循环深度从深到浅依次分配，
+ * 内层循环的区间可以使用全部寄存器，外层区间只能使用与已分配区间不冲突的寄存器，
+ * 因此溢出只会发生在外层，load/store 落在内层循环之外。
+ * spill 产生的短区间（vreg 编号 >= first_spill_vreg）再溢出没有意义，它们可以抢任何区域的寄存器。
+ * 压力超过寄存器数的循环中用到、在循环边界上活跃的 v 被溢出时，先在最内层这样的循环边界上拆分：
+ * 循环内改名为 v'，入口边上 mov v', v，循环内有定值时出口边上 mov v, v'，重新分配。
+ * 区间没有空洞，v 仍然跨过循环，通常下一轮被溢出，load / store 落在边界的 move 上；v' 也被溢出时撤销拆分
+ */
+#ifdef LOOP_REGION_ALLOCATION
+struct LoopSplits {
+  std::vector<MachineLoop *> loops;  // 压力超过寄存器数的循环，内层在前
+  // 循环内的 vreg 使用预留的编号 [next, end)，不会被当成 spill 产生的 vreg
+  i32 next = 0;
+  i32 end = 0;
+  // 循环内的 vreg -> (循环外的 vreg, 边界上的 move)
+  std::map<MachineOperand, std::pair<MachineOperand, std::vector<MIMove *>>> outer;
+  std::set<MachineOperand> tried;  // 每个 vreg 只拆分一次
+};
+
+static void reserve_loop_splits(MachineFunc *f, const MachineCFG &cfg, LoopSplits &splits) {
+  auto live = block_max_live(f);
+  i32 names = 0;
+  for (auto &l : cfg.loops) {
+    i32 max = 0;
+    std::set<MachineOperand> used;
+    for (auto bb : l->blocks) {
+      max = std::max(max, live[bb]);
+      for (auto inst = bb->insts.head; inst; inst = inst->next) {
+        auto [def, use] = get_def_use(inst);
+        use.insert(use.end(), def.begin(), def.end());
+        for (auto &o : use) {
+          if (o.state == MachineOperand::State::Virtual) {
+            used.insert(o);
+          }
+        }
+      }
+    }
+    if (max > ALLOCATABLE_END - ALLOCATABLE_BEGIN) {
+      splits.loops.push_back(l.get());
+      names += used.size();
+    }
+  }
+  std::stable_sort(splits.loops.begin(), splits.loops.end(),
+                   [](MachineLoop *a, MachineLoop *b) { return a->depth > b->depth; });
+  splits.next = f->virtual_max;
+  splits.end = f->virtual_max += names;
+}
+
+// 在循环边界上拆分被溢出的 vreg，有拆分时返回 true。需要当前的 livein
+static bool split_spilled_at_loops(MachineFunc *f, LoopSplits &splits, RegisterConstraints &c,
+                                   const std::set<MachineOperand> &spilled_nodes) {
+  if (splits.loops.empty()) {
+    return false;
+  }
+  struct LoopRefs {
+    std::set<MachineOperand> used, defined;
+    std::vector<std::pair<MachineBB *, MachineBB *>> exits;
+  };
+  std::vector<LoopRefs> refs(splits.loops.size());
+  for (size_t i = 0; i < splits.loops.size(); i++) {
+    auto l = splits.loops[i];
+    for (auto bb : l->blocks) {
+      for (auto s : bb->succ) {
+        if (s != nullptr && !l->blocks.count(s) &&
+            std::find(refs[i].exits.begin(), refs[i].exits.end(), std::make_pair(bb, s)) == refs[i].exits.end()) {
+          refs[i].exits.push_back({bb, s});
+        }
+      }
+      for (auto inst = bb->insts.head; inst; inst = inst->next) {
+        auto [def, use] = get_def_use(inst);
+        for (auto &o : def) {
+          refs[i].defined.insert(o);
+          refs[i].used.insert(o);
+        }
+        refs[i].used.insert(use.begin(), use.end());
+      }
+    }
+  }
+
+  bool changed = false;
+  for (auto &n : spilled_nodes) {
+    if (n.value >= splits.end || splits.outer.count(n) || !splits.tried.insert(n).second) {
+      continue;
+    }
+    // 选最内层的循环；兄弟循环各自拆分
+    std::vector<size_t> chosen;
+    for (size_t i = 0; i < splits.loops.size(); i++) {
+      auto l = splits.loops[i];
+      bool boundary = l->header->livein.count(n) > 0;
+      for (auto [bb, s] : refs[i].exits) {
+        boundary = boundary || (refs[i].defined.count(n) && s->livein.count(n));
+      }
+      bool nested = false;
+      for (auto k : chosen) {
+        nested = nested || l->blocks.count(splits.loops[k]->header);
+      }
+      if (refs[i].used.count(n) && boundary && !nested && splits.next < splits.end) {
+        chosen.push_back(i);
+      }
+    }
+    for (auto i : chosen) {
+      auto l = splits.loops[i];
+      auto inner = MachineOperand::V(splits.next++);
+      auto &split = splits.outer[inner];
+      split.first = n;
+      for (auto bb : l->blocks) {
+        for (auto inst = bb->insts.head; inst; inst = inst->next) {
+          auto [def, use] = get_defs_use_ptr(inst);
+          use.insert(use.end(), def.begin(), def.end());
+          for (MachineOperand *o : use) {
+            if (*o == n) {
+              *o = inner;
+            }
+          }
+        }
+      }
+      if (l->header->livein.count(n)) {
+        auto preds = machine_cfg(f).preds[l->header];  // 拆分入口边会改动 preds
+        for (auto pred : preds) {
+          if (!l->blocks.count(pred)) {
+            auto moves = insert_edge_moves(f, pred, l->header, {{inner, n}});
+            split.second.insert(split.second.end(), moves.begin(), moves.end());
+          }
+        }
+      }
+      for (auto [bb, s] : refs[i].exits) {
+        if (refs[i].defined.count(n) && s->livein.count(n)) {
+          auto moves = insert_edge_moves(f, bb, s, {{n, inner}});
+          split.second.insert(split.second.end(), moves.begin(), moves.end());
+        }
+      }
+      add_same_hint(c.hints, inner, n);
+      auto report = "Splitting v" + std::to_string(n.value) + " at the loop of depth " + std::to_string(l->depth);
+      dbg(report);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// 循环内的 vreg 也被溢出时拆分没有意义（边界上变成内存到内存的复制），改回原来的 vreg，有撤销时返回 true。
+// 循环外的 vreg 已经被溢出时改回去也一样，直接按普通 vreg 溢出
+static bool undo_spilled_splits(MachineFunc *f, LoopSplits &splits, const std::set<MachineOperand> &spilled_nodes) {
+  std::map<MachineOperand, MachineOperand> restore;
+  for (auto &n : spilled_nodes) {
+    auto it = splits.outer.find(n);
+    if (it == splits.outer.end()) {
+      continue;
+    }
+    auto &[outer, moves] = it->second;
+    bool outer_live = false;
+    for (auto mv : moves) {
+      outer_live = outer_live || mv->dst == outer || mv->rhs == outer;
+    }
+    if (outer_live) {
+      auto undo = "Unsplitting v" + std::to_string(n.value);
+      dbg(undo);
+      restore[n] = outer;
+      for (auto mv : moves) {
+        mv->bb->insts.remove(mv);
+      }
+    }
+    splits.outer.erase(it);
+  }
+  if (restore.empty()) {
+    return false;
+  }
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_defs_use_ptr(inst);
+      use.insert(use.end(), def.begin(), def.end());
+      for (MachineOperand *o : use) {
+        auto it = restore.find(*o);
+        if (it != restore.end()) {
+          *o = it->second;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+static std::vector<i32> interval_loop_depth(const std::vector<MachineBB *> &dfs, const MachineCFG &cfg,
+                                            const std::map<MachineOperand, i32> &interval_id) {
+  std::vector<i32> depth(interval_id.size(), 0);
+  for (auto bb : dfs) {
+    i32 d = cfg.depth(bb);
+    if (d == 0) {
+      continue;
+    }
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_defs_use_ptr(inst);
+      use.insert(use.end(), def.begin(), def.end());
+      for (MachineOperand *o : use) {
+        auto it = interval_id.find(*o);
+        if (it != interval_id.end()) {
+          depth[it->second] = std::max(depth[it->second], d);
+        }
+      }
+    }
+  }
+  return depth;
+}
+
+// 每个寄存器上已分配的区间互不重叠，按起点排序：start -> (end, 区间编号)，
+// 因此终点也是递增的，与 [s, e] 重叠的区间是起点不超过 e 的最后几个
+using RegisterLane = std::map<i32, std::pair<i32, i32>>;
+
+template <typename F>
+static void for_each_overlap(const RegisterLane &lane, i32 s, i32 e, F f) {
+  for (auto it = lane.upper_bound(e); it != lane.begin();) {
+    --it;
+    if (it->second.first < s) {
+      break;
+    }
+    f(it->second.second);
+  }
+}
+
+// lane 中唯一与 [s, e] 重叠的区间编号，没有时为 -1，多于一个时为 -2
+static i32 lane_owner(const RegisterLane &lane, i32 s, i32 e) {
+  auto it = lane.upper_bound(e);
+  if (it == lane.begin() || (--it)->second.first < s) {
+    return -1;
+  }
+  if (it != lane.begin() && std::prev(it)->second.first >= s) {
+    return -2;
+  }
+  return it->second.second;
+}
+
+// fixed interval 同一个寄存器上可能重叠：按起点排序，max_end[k] 为前 k + 1 个的最大终点
+struct FixedLane {
+  std::vector<i32> starts;
+  std::vector<i32> max_end;
+
+  bool overlaps(i32 s, i32 e) const {
+    size_t k = std::upper_bound(starts.begin(), starts.end(), e) - starts.begin();
+    return k > 0 && max_end[k - 1] >= s;
+  }
+};
+
+static std::vector<FixedLane> fixed_lanes(const IntervalSoA &fixed) {
+  std::vector<std::vector<std::pair<i32, i32>>> segments(ALLOCATABLE_END);
+  for (size_t k = 0; k < fixed.size(); k++) {
+    segments[fixed.reg[k]].push_back({fixed.starts[k], fixed.ends[k]});
+  }
+  std::vector<FixedLane> lanes(ALLOCATABLE_END);
+  for (i32 r = ALLOCATABLE_BEGIN; r < ALLOCATABLE_END; r++) {
+    std::sort(segments[r].begin(), segments[r].end());
+    i32 max_end = INT32_MIN;
+    for (auto [s, e] : segments[r]) {
+      max_end = std::max(max_end, e);
+      lanes[r].starts.push_back(s);
+      lanes[r].max_end.push_back(max_end);
+    }
+  }
+  return lanes;
+}
+
+// 超出预算时返回 false，此时的结果不完整
+static bool allocate_by_region(IntervalSoA &intervals, const IntervalSoA &fixed, const std::vector<i32> &depth,
+                               const std::vector<MachineOperand> &interval_oper, i32 first_spill_vreg,
+                               IntervalHints &hints, std::set<MachineOperand> &spilled_nodes,
+                               std::chrono::steady_clock::time_point deadline) {
+  std::vector<i32> order(interval_oper.size());
+  for (i32 i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](i32 a, i32 b) {
+    return depth[a] != depth[b] ? depth[a] > depth[b] : intervals.starts[a] < intervals.starts[b];
+  });
+
+  auto fixed_lane = fixed_lanes(fixed);
+  std::vector<RegisterLane> lanes(ALLOCATABLE_END);
+  u32 checked = 0;
+  for (i32 id : order) {
+    if (over_budget(checked, deadline)) {
+      return false;
+    }
+    i32 s = intervals.starts[id];
+    i32 e = intervals.ends[id];
+    // owner[r] 为 r 上唯一与 [s, e] 冲突的区间
+    i32 owner[ALLOCATABLE_END];
+    std::fill(owner, owner + ALLOCATABLE_END, -1);
+    u32 fixed_busy = 0, busy = 0;
+    for (i32 r = ALLOCATABLE_BEGIN; r < ALLOCATABLE_END; r++) {
+      if (fixed_lane[r].overlaps(s, e)) {
+        fixed_busy |= 1u << r;
+      }
+      owner[r] = lane_owner(lanes[r], s, e);
+      if (owner[r] != -1) {
+        busy |= 1u << r;
+      }
+    }
+    i32 reg = hinted_free_reg(busy | fixed_busy, id, intervals, hints);
+    if (reg == -1) {
+      // 某个寄存器上与 [s, e] 冲突的恰好是一个区间时可以抢过来：
+      // 普通区间只抢同一区域内结束更晚的普通区间，spill 产生的区间优先抢最外层的
+      bool spill_temp = interval_oper[id].value >= first_spill_vreg;
+      i32 victim = -1;
+      for (i32 r = ALLOCATABLE_BEGIN; r < ALLOCATABLE_END; r++) {
+        i32 other = owner[r];
+        if (other < 0 || (fixed_busy >> r & 1u) || interval_oper[other].value >= first_spill_vreg) {
+          continue;
+        }
+        if (spill_temp) {
+          if (victim == -1 || depth[other] < depth[victim] ||
+              (depth[other] == depth[victim] && intervals.ends[other] > intervals.ends[victim])) {
+            victim = other;
+          }
+        } else if (depth[other] == depth[id] && intervals.ends[other] > e &&
+                   (victim == -1 || intervals.ends[other] > intervals.ends[victim])) {
+          victim = other;
+        }
+      }
+      if (victim == -1) {
+        // spill 产生的区间再溢出不一定会变短：改为溢出与它重叠、跨度最大且比它长的区间，本轮它不分配寄存器
+        i32 longest = -1;
+        auto span = [&](i32 k) { return intervals.ends[k] - intervals.starts[k]; };
+        for (i32 r = ALLOCATABLE_BEGIN; r < ALLOCATABLE_END && spill_temp; r++) {
+          for_each_overlap(lanes[r], s, e, [&](i32 k) {
+            if (span(k) > e - s && (longest == -1 || span(k) > span(longest))) {
+              longest = k;
+            }
+          });
+        }
+        spilled_nodes.insert(interval_oper[longest == -1 ? id : longest]);
+        continue;
+      }
+      reg = intervals.reg[victim];
+      intervals.reg[victim] = -1;
+      spilled_nodes.insert(interval_oper[victim]);
+      lanes[reg].erase(intervals.starts[victim]);
+    }
+    intervals.reg[id] = reg;
+    lanes[reg][s] = {e, id};
+  }
+  return true;
+}
+#endif
+
+/********************************
+ * trace 分配
+ * 按块频率把基本块串成 trace：从频率最高的未划分块出发，沿概率最大的后继向前延伸。
+ * 只在一个 trace 内出现、且不跨越 trace 边界的 vreg 称为 trace 局部的，
+ * 冷 trace（不在循环中）和大 trace（指令数 >= LOCAL_ALLOC_MIN_INSTS）的局部 vreg 不参与全局分配，
+ * 在全局分配完成后按 trace 各自顺序扫描一遍 (Belady MIN)：寄存器不够时换出下一次使用最远的值。
+ * 局部 vreg 不会在 trace 边界上活跃，所以边界上不需要插入 resolution move；
+ * 各 trace 的方案只读指令，可以在多个线程上并行计算
+ */
+constexpr int LOCAL_ALLOC_MIN_INSTS = 1000;
+constexpr int PARALLEL_TRACE_MIN_INSTS = 4096;
+
+struct Trace {
+  std::vector<MachineBB *> blocks;
+  std::vector<i32> begin;  // 每个块第一条指令的编号
+  std::set<MachineOperand> local;
+};
+
+struct LocalPlan {
+  // 在 before 之前插入 ldr/str reg, [sp, #offset]
+  struct Access {
+    MachineInst *before;
+    bool load;
+    i32 reg;
+    i32 offset;
+  };
+  std::vector<std::pair<MachineOperand *, i32>> rewrite;
+  std::vector<Access> access;
+  i32 slots = 0;
+};
+
+static MachineOperand allocated_reg(i32 reg) {
+  auto o = MachineOperand::V(reg);
+  o.state = MachineOperand::State::Allocated;
+  return o;
+}
+
+static std::vector<Trace> form_traces(const std::vector<MachineBB *> &dfs, const std::vector<i32> &bb_begin,
+                                      const MachineCFG &cfg) {
+  std::map<MachineBB *, i32> index;
+  for (i32 i = 0; i < dfs.size(); i++) {
+    index[dfs[i]] = i;
+  }
+  std::vector<double> freq(dfs.size());
+  std::vector<i32> order(dfs.size());
+  for (i32 i = 0; i < dfs.size(); i++) {
+    freq[i] = cfg.frequency(dfs[i]);
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](i32 a, i32 b) { return freq[a] > freq[b]; });
+
+  std::vector<bool> placed(dfs.size(), false);
+  std::vector<Trace> traces;
+  for (i32 seed : order) {
+    if (placed[seed]) {
+      continue;
+    }
+    Trace t;
+    for (i32 cur = seed; cur != -1;) {
+      placed[cur] = true;
+      t.blocks.push_back(dfs[cur]);
+      t.begin.push_back(bb_begin[cur]);
+      i32 next = -1;
+      double best = -1;
+      for (auto succ : dfs[cur]->succ) {
+        auto it = succ ? index.find(succ) : index.end();
+        if (it != index.end() && !placed[it->second] && cfg.probability(dfs[cur], succ) > best) {
+          next = it->second;
+          best = cfg.probability(dfs[cur], succ);
+        }
+      }
+      cur = next;
+    }
+    traces.push_back(std::move(t));
+  }
+  return traces;
+}
+
+// 找出每个 trace 的局部 vreg，只处理 eligible 中的 trace
+static void find_trace_local_vregs(MachineFunc *f, std::vector<Trace> &traces, const std::vector<bool> &eligible) {
+  std::map<MachineBB *, i32> trace_of;
+  std::map<MachineBB *, i32> pred_count;
+  for (i32 i = 0; i < traces.size(); i++) {
+    for (auto bb : traces[i].blocks) {
+      trace_of[bb] = i;
+    }
+  }
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto succ : bb->succ) {
+      if (succ) {
+        pred_count[succ]++;
+      }
+    }
+  }
+
+  std::map<MachineOperand, i32> home;
+  std::set<MachineOperand> shared;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    auto it = trace_of.find(bb);
+    i32 t = it == trace_of.end() ? -1 : it->second;
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_defs_use_ptr(inst);
+      use.insert(use.end(), def.begin(), def.end());
+      for (MachineOperand *o : use) {
+        if (o->state == MachineOperand::State::Virtual) {
+          auto [h, inserted] = home.insert({*o, t});
+          if (t == -1 || (!inserted && h->second != t)) {
+            shared.insert(*o);
+          }
+        }
+      }
+    }
+  }
+
+  // 局部 vreg 不能从 trace 外流入或流出：只能沿 trace 内部的边活跃，且流入的块只有一个前驱
+  for (i32 i = 0; i < traces.size(); i++) {
+    auto &blocks = traces[i].blocks;
+    for (i32 k = 0; k < blocks.size(); k++) {
+      auto bb = blocks[k];
+      bool single_entry = k > 0 && pred_count[bb] == 1;
+      if (!single_entry) {
+        shared.insert(bb->livein.begin(), bb->livein.end());
+      }
+      if (k + 1 == blocks.size()) {
+        shared.insert(bb->liveout.begin(), bb->liveout.end());
+      }
+    }
+  }
+  for (auto &[o, t] : home) {
+    if (t != -1 && eligible[t] && !shared.count(o)) {
+      traces[t].local.insert(o);
+    }
+  }
+}
+
+// 为一个 trace 的局部 vreg 生成分配方案，失败（寄存器或栈偏移不够）时返回 false，此时不修改任何指令
+// global_reg 为已经分配好的全局 vreg，slot_base 为可用的栈偏移起点
+static bool plan_local_trace(const Trace &trace, const std::map<MachineOperand, i32> &global_reg,
+                             const std::map<MachineOperand, RegisterHint> &hints, const IntervalSoA &fixed,
+                             i32 slot_base, LocalPlan &plan) {
+  MemoryPhase phase(Phase::LocalPlan);
+  const auto &local = trace.local;
+  std::vector<MachineInst *> insts;
+  for (auto bb : trace.blocks) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      insts.push_back(inst);
+    }
+  }
+  i32 n = insts.size();
+
+  // 全局 vreg 按真实的活跃性占用寄存器（区间只是包络，会高估）：
+  // busy_after[idx] 为 inst 之后活跃或 inst 定值的全局寄存器，busy_before[idx] 为 inst 之前活跃的
+  std::vector<u32> busy_after(n), busy_before(n);
+  auto reg_mask = [&](const std::set<MachineOperand> &live) {
+    u32 mask = 0;
+    for (auto &o : live) {
+      auto it = global_reg.find(o);
+      if (it != global_reg.end()) {
+        mask |= 1u << it->second;
+      }
+    }
+    return mask;
+  };
+  for (i32 k = trace.blocks.size() - 1, idx = n - 1; k >= 0; k--) {
+    auto bb = trace.blocks[k];
+    std::set<MachineOperand> live;
+    for (auto &o : bb->liveout) {
+      if (global_reg.count(o)) {
+        live.insert(o);
+      }
+    }
+    i32 pos = trace.begin[k];
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      pos++;
+    }
+    for (auto inst = bb->insts.tail; inst; inst = inst->prev, idx--) {
+      pos--;
+      auto [def, use] = get_def_use(inst);
+      u32 fixed_busy = busy_mask(fixed, pos, pos);
+      u32 after = reg_mask(live) | fixed_busy;
+      for (auto &d : def) {
+        auto it = global_reg.find(d);
+        if (it != global_reg.end()) {
+          after |= 1u << it->second;
+          live.erase(d);
+        }
+      }
+      for (auto &u : use) {
+        if (global_reg.count(u)) {
+          live.insert(u);
+        }
+      }
+      busy_after[idx] = after;
+      busy_before[idx] = reg_mask(live) | fixed_busy;
+    }
+  }
+
+  // 反向计算每次出现之后的下一次使用，-1 表示之后不再使用
+  struct Occ {
+    MachineOperand *op;
+    i32 next;
+  };
+  std::vector<std::vector<Occ>> uses(n);
+  std::vector<std::vector<Occ>> defs(n);
+  std::map<i32, i32> next;
+  auto next_of = [&](i32 v) {
+    auto it = next.find(v);
+    return it == next.end() ? -1 : it->second;
+  };
+  for (i32 idx = n - 1; idx >= 0; idx--) {
+    auto [def, use] = get_defs_use_ptr(insts[idx]);
+    for (MachineOperand *d : def) {
+      if (local.count(*d)) {
+        defs[idx].push_back({d, next_of(d->value)});
+        next.erase(d->value);
+      }
+    }
+    for (MachineOperand *u : use) {
+      if (local.count(*u)) {
+        uses[idx].push_back({u, next_of(u->value)});
+      }
+    }
+    for (auto &occ : uses[idx]) {
+      next[occ.op->value] = idx;
+    }
+  }
+
+  struct Value {
+    i32 reg = -1;
+    i32 slot = -1;
+    bool dirty = false;
+    i32 next = -1;
+  };
+  std::map<i32, Value> val;
+  i32 owner[ALLOCATABLE_END];
+  std::fill(owner, owner + ALLOCATABLE_END, -1);
+
+  bool ok = true;
+  auto release = [&](i32 v) {
+    Value &x = val[v];
+    owner[x.reg] = -1;
+    x.reg = -1;
+  };
+  // 换出前如果之后还会用到且值没有写回，在 inst 前插入 str
+  auto write_back = [&](i32 v, MachineInst *inst) {
+    Value &x = val[v];
+    if (x.dirty && x.next != -1) {
+      if (x.slot == -1) {
+        x.slot = plan.slots++;
+      }
+      if (slot_base + x.slot * 4 >= (1 << 12)) {  // ldr / str has only imm12
+        ok = false;
+      }
+      plan.access.push_back({inst, false, x.reg, slot_base + x.slot * 4});
+      x.dirty = false;
+    }
+  };
+  // v 偏好的寄存器：hint 指定的，或者 same 指向的 vreg 所在的
+  auto preferred = [&](i32 v) {
+    auto it = hints.find(MachineOperand::V(v));
+    if (it == hints.end()) {
+      return -1;
+    }
+    if (it->second.reg >= ALLOCATABLE_BEGIN && it->second.reg < ALLOCATABLE_END) {
+      return it->second.reg;
+    }
+    auto same = MachineOperand::V(it->second.same);
+    auto global = global_reg.find(same);
+    if (global != global_reg.end()) {
+      return global->second;
+    }
+    auto other = val.find(same.value);
+    return other == val.end() ? -1 : other->second.reg;
+  };
+  // 给 v 选一个不在 avoid 中的寄存器：偏好的寄存器空闲时用它，必要时换出下一次使用最远的值
+  auto pick = [&](i32 v, u32 avoid, MachineInst *inst) {
+    i32 want = preferred(v);
+    if (want != -1 && !(avoid >> want & 1u) && owner[want] == -1) {
+      return want;
+    }
+    i32 victim = -1;
+    for (i32 r = ALLOCATABLE_BEGIN; r < ALLOCATABLE_END; r++) {
+      if (avoid >> r & 1u) {
+        continue;
+      }
+      if (owner[r] == -1) {
+        return r;
+      }
+      if (victim == -1 || val[owner[r]].next > val[owner[victim]].next) {
+        victim = r;
+      }
+    }
+    if (victim != -1) {
+      write_back(owner[victim], inst);
+      release(owner[victim]);
+    }
+    return victim;
+  };
+
+  for (i32 idx = 0; idx < n && ok; idx++) {
+    MachineInst *inst = insts[idx];
+    u32 cur_busy = busy_after[idx];
+    u32 prev_busy = busy_before[idx];
+    u32 pinned = 0;
+    for (auto &occ : uses[idx]) {
+      Value &x = val[occ.op->value];
+      if (x.reg != -1) {
+        pinned |= 1u << x.reg;
+      }
+    }
+
+    // 全局区间从这里开始占用的寄存器，上面的局部值要让出来
+    std::vector<i32> drop;
+    for (i32 r = ALLOCATABLE_BEGIN; r < ALLOCATABLE_END; r++) {
+      if (owner[r] != -1 && (cur_busy >> r & 1u)) {
+        write_back(owner[r], inst);
+        if (pinned >> r & 1u) {
+          drop.push_back(owner[r]);
+        } else {
+          release(owner[r]);
+        }
+      }
+    }
+
+    // use：不在寄存器里的值需要 reload
+    for (auto &occ : uses[idx]) {
+      i32 v = occ.op->value;
+      if (val[v].reg == -1) {
+        i32 r = pick(v, prev_busy | cur_busy | pinned, inst);
+        Value &x = val[v];
+        if (r == -1 || x.slot == -1) {
+          return false;
+        }
+        plan.access.push_back({inst, true, r, slot_base + x.slot * 4});
+        x.reg = r;
+        x.dirty = false;
+        owner[r] = v;
+        pinned |= 1u << r;
+      }
+    }
+    for (auto &occ : uses[idx]) {
+      Value &x = val[occ.op->value];
+      plan.rewrite.push_back({occ.op, x.reg});
+      x.next = occ.next;
+    }
+
+    for (i32 v : drop) {
+      // 读写同一个操作数时 def 必须沿用 use 的寄存器，被全局区间占用就无法满足
+      for (auto &d : defs[idx]) {
+        if (d.op->value == v) {
+          return false;
+        }
+      }
+      if (val[v].reg != -1) {
+        release(v);
+      }
+    }
+    for (auto &occ : uses[idx]) {
+      Value &x = val[occ.op->value];
+      bool redefined = false;
+      for (auto &d : defs[idx]) {
+        redefined |= d.op->value == occ.op->value;
+      }
+      if (x.reg != -1 && x.next == -1 && !redefined) {
+        release(occ.op->value);
+      }
+    }
+
+    // def：同一条指令既读又写时沿用读的寄存器，同一条指令的多个 def 不能共用寄存器
+    u32 def_pinned = 0;
+    for (auto &[def_op, def_next] : defs[idx]) {
+      i32 v = def_op->value;
+      if (val[v].reg != -1 && (cur_busy >> val[v].reg & 1u)) {
+        return false;
+      }
+      if (val[v].reg == -1) {
+        u32 live_pinned = def_pinned;
+        for (auto &occ : uses[idx]) {
+          if (val[occ.op->value].reg != -1) {
+            live_pinned |= 1u << val[occ.op->value].reg;
+          }
+        }
+        i32 r = pick(v, cur_busy | live_pinned, inst);
+        if (r == -1) {
+          return false;
+        }
+        val[v].reg = r;
+        owner[r] = v;
+      }
+      Value &x = val[v];
+      x.dirty = true;
+      x.next = def_next;
+      def_pinned |= 1u << x.reg;
+      plan.rewrite.push_back({def_op, x.reg});
+      if (x.next == -1) {
+        release(v);
+      }
+    }
+  }
+  return ok;
+}
+
+static void apply_local_plan(const LocalPlan &plan) {
+  for (auto &[op, reg] : plan.rewrite) {
+    op->state = MachineOperand::State::Allocated;
+    op->value = reg;
+  }
+  for (auto &a : plan.access) {
+    auto bb = a.before->bb;
+    if (a.load) {
+      auto load_inst = new MILoad(a.before);
+      load_inst->bb = bb;
+      load_inst->addr = MachineOperand::R(ArmReg::sp);
+      load_inst->offset = MachineOperand::I(a.offset);
+      load_inst->shift = 0;
+      load_inst->dst = allocated_reg(a.reg);
+    } else {
+      auto store_inst = new MIStore();
+      store_inst->bb = bb;
+      store_inst->addr = MachineOperand::R(ArmReg::sp);
+      store_inst->offset = MachineOperand::I(a.offset);
+      store_inst->shift = 0;
+      bb->insts.insertBefore(store_inst, a.before);
+      store_inst->data = allocated_reg(a.reg);
+    }
+  }
+}
+
+// 计算所有局部 trace 的方案，指令足够多时分到 pool 的线程上
+static void plan_local_traces(const std::vector<Trace> &traces, const std::map<MachineOperand, i32> &global_reg,
+                              const std::map<MachineOperand, RegisterHint> &hints, const IntervalSoA &fixed,
+                              i32 slot_base, WorkerPool *pool, std::vector<LocalPlan> &plans,
+                              std::vector<char> &ok) {
+  plans.assign(traces.size(), LocalPlan());
+  ok.assign(traces.size(), 1);
+  std::vector<i32> work;
+  size_t total = 0;
+  for (i32 i = 0; i < traces.size(); i++) {
+    if (!traces[i].local.empty()) {
+      work.push_back(i);
+      for (auto bb : traces[i].blocks) {
+        for (auto inst = bb->insts.head; inst; inst = inst->next) {
+          total++;
+        }
+      }
+    }
+  }
+
+  std::atomic<size_t> cursor(0);
+  auto worker = [&]() {
+    for (size_t k; (k = cursor++) < work.size();) {
+      i32 i = work[k];
+      ok[i] = plan_local_trace(traces[i], global_reg, hints, fixed, slot_base, plans[i]);
+    }
+  };
+  if (!pool || total < PARALLEL_TRACE_MIN_INSTS || work.size() < 2) {
+    worker();
+    return;
+  }
+  pool->run(Phase::LocalPlan, worker);
+}
+
+// 块数或指令数足够多、能用多个线程时才创建
+static std::unique_ptr<WorkerPool> make_worker_pool(MachineFunc *f) {
+  if (worker_threads() < 2) {
+    return nullptr;
+  }
+  i32 blocks = 0, insts = 0;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    blocks++;
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      insts++;
+    }
+  }
+  if (blocks < PARALLEL_LIVENESS_MIN_BLOCKS && insts < PARALLEL_TRACE_MIN_INSTS) {
+    return nullptr;
+  }
+  return std::make_unique<WorkerPool>(worker_threads());
+}
+
+/********************************
+ * 干涉图：邻接关系存为位矩阵，forbid[v] 为与 v 同时活跃的 r4 ~ r12 precolored 寄存器
+ * move 的源和目标之间不连边
+ */
+struct InterferenceGraph {
+  i32 n = 0;
+  i32 words = 0;
+  std::vector<u64> bits;
+  std::vector<u32> forbid;
+
+  void init(i32 size) {
+    n = size;
+    words = (size + 63) / 64;
+    bits.assign((size_t)n * words, 0);
+    forbid.assign(n, 0);
+  }
+
+  void add(i32 a, i32 b) {
+    bits[(size_t)a * words + b / 64] |= 1ull << (b % 64);
+    bits[(size_t)b * words + a / 64] |= 1ull << (a % 64);
+  }
+
+  bool test(i32 a, i32 b) const { return bits[(size_t)a * words + b / 64] >> (b % 64) & 1u; }
+};
+
+static MachineOperand *plain_move_src(MachineInst *inst) {
+  if (auto x = dyn_cast<MIMove>(inst)) {
+    if (x->cond == ArmCond::Any && x->shift.is_none() && x->rhs.state == MachineOperand::State::Virtual) {
+      return &x->rhs;
+    }
+  }
+  return nullptr;
+}
+
+// 从 liveout 向前扫描一个块，边和 forbid 记到 g
+static void scan_interference(MachineBB *bb, const std::map<MachineOperand, i32> &interval_id, InterferenceGraph &g) {
+  auto in_range = [](const MachineOperand &o) {
+    return is_physical(o) && o.value >= ALLOCATABLE_BEGIN && o.value < ALLOCATABLE_END;
+  };
+  std::set<i32> live;
+  u32 phys = 0;
+  for (auto &o : bb->liveout) {
+    auto it = interval_id.find(o);
+    if (it != interval_id.end()) {
+      live.insert(it->second);
+    } else if (in_range(o)) {
+      phys |= 1u << o.value;
+    }
+  }
+  for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
+    auto [def, use] = get_def_use(inst);
+    i32 move_src = -1;
+    if (auto src = plain_move_src(inst)) {
+      auto it = interval_id.find(*src);
+      move_src = it == interval_id.end() ? -1 : it->second;
+    }
+    for (auto &d : def) {
+      auto it = interval_id.find(d);
+      if (it != interval_id.end()) {
+        g.forbid[it->second] |= phys;
+        for (i32 l : live) {
+          if (l != it->second && l != move_src) {
+            g.add(it->second, l);
+          }
+        }
+      } else if (in_range(d)) {
+        for (i32 l : live) {
+          g.forbid[l] |= 1u << d.value;
+        }
+      }
+    }
+    for (auto &d : def) {
+      auto it = interval_id.find(d);
+      if (it != interval_id.end()) {
+        live.erase(it->second);
+      } else if (in_range(d)) {
+        phys &= ~(1u << d.value);
+      }
+    }
+    for (auto &u : use) {
+      auto it = interval_id.find(u);
+      if (it != interval_id.end()) {
+        live.insert(it->second);
+      } else if (in_range(u)) {
+        phys |= 1u << u.value;
+      }
+    }
+  }
+}
+
+// 指令足够多时按指令数把块切成区间，每个线程扫描一段到自己的位矩阵，最后按行 OR 到 g 中。
+// 每个线程多一份 n * n 位的矩阵，总量超过 MAX_INTERFERENCE_COPY_BYTES 时减少线程数
+constexpr int PARALLEL_INTERFERENCE_MIN_INSTS = 8192;
+constexpr size_t MAX_INTERFERENCE_COPY_BYTES = 128 << 20;
+
+static void build_interference(const std::vector<MachineBB *> &dfs, const std::map<MachineOperand, i32> &interval_id,
+                               WorkerPool *pool, InterferenceGraph &g) {
+  MemoryPhase phase(Phase::Interference);
+  g.init(interval_id.size());
+  std::vector<size_t> prefix = {0};
+  for (auto bb : dfs) {
+    size_t size = 0;
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      size++;
+    }
+    prefix.push_back(prefix.back() + size);
+  }
+  size_t ranges = 0;
+  if (pool && prefix.back() >= PARALLEL_INTERFERENCE_MIN_INSTS) {
+    size_t matrix = std::max<size_t>(g.bits.size() * sizeof(u64), 1);
+    ranges = std::min(pool->workers.size(), MAX_INTERFERENCE_COPY_BYTES / matrix + 1);
+  }
+  if (ranges < 2) {
+    for (auto bb : dfs) {
+      scan_interference(bb, interval_id, g);
+    }
+    return;
+  }
+
+  // 区间 0 直接写入 g，其余区间各用一份局部矩阵
+  std::vector<size_t> split = {0};
+  for (size_t k = 1, r = 1; k < dfs.size() && r < ranges; k++) {
+    if (prefix[k] * ranges >= prefix.back() * r) {
+      split.push_back(k);
+      r++;
+    }
+  }
+  split.push_back(dfs.size());
+  std::vector<InterferenceGraph> local(split.size() - 2);
+  std::atomic<size_t> cursor(0);
+  pool->run(Phase::Interference, [&]() {
+    for (size_t r; (r = cursor++) + 1 < split.size();) {
+      auto &target = r == 0 ? g : local[r - 1];
+      if (r > 0) {
+        target.init(g.n);
+      }
+      for (size_t k = split[r]; k < split[r + 1]; k++) {
+        scan_interference(dfs[k], interval_id, target);
+      }
+    }
+  });
+
+  // 按 64 行一组归约，各组互不重叠
+  std::atomic<i32> row_cursor(0);
+  pool->run(Phase::Interference, [&]() {
+    for (i32 begin; (begin = row_cursor.fetch_add(64)) < g.n;) {
+      size_t lo = (size_t)begin * g.words, hi = (size_t)std::min(begin + 64, g.n) * g.words;
+      for (auto &l : local) {
+        for (size_t w = lo; w < hi; w++) {
+          g.bits[w] |= l.bits[w];
+        }
+        for (i32 v = begin; v < std::min(begin + 64, g.n); v++) {
+          g.forbid[v] |= l.forbid[v];
+        }
+      }
+    }
+  });
+}
+
+/********************************
+ * 小函数的精确分配 (branch-and-bound)
+ * 在循环中被调用或自身含循环、指令数不超过 EXACT_MAX_INSTS 的函数，在干涉图上枚举每个 vreg 的寄存器或 spill，
+ * 代价为按块频率加权的 load/store/move 周期数，寄存器偏好没有满足时加一个 move 的代价。
+ * 每个函数至多求解一次：启发式分配（包括合并的撤销）对原来的 vreg 得出最终结果、并且确实有溢出时才做，
+ * 之后 spill 产生的 vreg 只交给启发式分配。
+ * 启发式分配的结果作为初始上界，超过 EXACT_TIME_LIMIT_MS 时保留已找到的最优解
+ */
+// #define EXACT_SMALL_FUNCTION_ALLOCATION
+
+constexpr int EXACT_MAX_INSTS = 200;
+constexpr int EXACT_TIME_LIMIT_MS = 20;
+// 周期模型
+constexpr i64 LOAD_CYCLES = 3;
+constexpr i64 STORE_CYCLES = 1;
+constexpr i64 MOVE_CYCLES = 1;
+// 块权重的上限，深层循环的频率不会让代价溢出
+constexpr i64 MAX_BLOCK_WEIGHT = (i64)1 << 20;
+// spill 产生的 vreg 再溢出没有意义，给一个足够大的代价
+constexpr i64 SPILL_TEMP_COST = (i64)1 << 40;
+constexpr i64 INFINITE_COST = INT64_MAX;
+// 普通 vreg 的代价之和（每条指令至多 4 个操作数、1 个 move）小于 SPILL_TEMP_COST，
+// 所有 vreg 的代价之和不会溢出
+static_assert(EXACT_MAX_INSTS * (4 * LOAD_CYCLES + MOVE_CYCLES) * MAX_BLOCK_WEIGHT < SPILL_TEMP_COST, "");
+static_assert(SPILL_TEMP_COST < INFINITE_COST / (EXACT_MAX_INSTS * 4), "");
+
+// 代价模型中块的权重：块频率取整，入口块为 16
+static i64 block_weight(const MachineCFG &cfg, MachineBB *bb) {
+  return std::max<i64>(1, std::llround(std::min(cfg.frequency(bb) * 16, (double)MAX_BLOCK_WEIGHT)));
+}
+
+#ifdef EXACT_SMALL_FUNCTION_ALLOCATION
+struct ExactSolver {
+  static constexpr i32 UNASSIGNED = -1;
+  static constexpr i32 SPILLED = -2;
+
+  const InterferenceGraph &g;
+  std::vector<i64> spill_cost;
+  std::vector<std::vector<std::pair<i32, i64>>> moves;  // (另一端, 加权 move 代价)
+  std::vector<i32> prefer;                               // 偏好的寄存器
+  std::vector<i32> order;
+  std::vector<i32> assign;
+  std::vector<i32> best;
+  i64 best_cost = INFINITE_COST;
+  u32 special = 0;  // 有 vreg 不能使用的寄存器，不参与对称性剪枝
+  u64 nodes = 0;
+  bool timeout = false;
+  std::chrono::steady_clock::time_point deadline;
+
+  explicit ExactSolver(const InterferenceGraph &g)
+      : g(g), spill_cost(g.n, 0), moves(g.n), prefer(g.n, -1), assign(g.n, UNASSIGNED) {}
+
+  // 与已分配的 move 另一端不在同一个寄存器、或者不在偏好的寄存器时的代价
+  i64 move_cost(i32 v, i32 r) const {
+    i64 c = prefer[v] != -1 && r != prefer[v] ? MOVE_CYCLES : 0;
+    for (auto [p, w] : moves[v]) {
+      if (assign[p] != UNASSIGNED && (r == SPILLED || assign[p] != r)) {
+        c += w;
+      }
+    }
+    return c;
+  }
+
+  // 完整方案的代价，方案不合法时返回 INFINITE_COST
+  i64 evaluate(const std::vector<i32> &a) {
+    assign = a;
+    i64 cost = 0;
+    for (i32 v = 0; v < g.n; v++) {
+      if (a[v] == SPILLED) {
+        cost += spill_cost[v];
+        continue;
+      }
+      if (g.forbid[v] >> a[v] & 1u) {
+        cost = INFINITE_COST;
+        break;
+      }
+      for (i32 u = 0; u < v; u++) {
+        if (a[u] == a[v] && g.test(u, v)) {
+          cost = INFINITE_COST;
+          break;
+        }
+      }
+      if (cost == INFINITE_COST) {
+        break;
+      }
+      for (auto [p, w] : moves[v]) {
+        if (p < v && a[p] != a[v]) {
+          cost += w;
+        }
+      }
+    }
+    for (i32 v = 0; v < g.n && cost != INFINITE_COST; v++) {
+      if (prefer[v] != -1 && a[v] != prefer[v]) {
+        cost += MOVE_CYCLES;
+      }
+    }
+    std::fill(assign.begin(), assign.end(), UNASSIGNED);
+    return cost;
+  }
+
+  void search(i32 k, i64 cost, u32 used) {
+    if (cost >= best_cost || timeout) {
+      return;
+    }
+    if (k == g.n) {
+      best = assign;
+      best_cost = cost;
+      return;
+    }
+    if ((++nodes & 1023u) == 0 && std::chrono::steady_clock::now() > deadline) {
+      timeout = true;
+      return;
+    }
+    i32 v = order[k];
+    u32 busy = g.forbid[v];
+    for (i32 u = 0; u < g.n; u++) {
+      if (assign[u] >= 0 && g.test(u, v)) {
+        busy |= 1u << assign[u];
+      }
+    }
+    // 未被使用过的寄存器彼此等价，只尝试第一个
+    std::vector<std::pair<i64, i32>> choices;
+    bool fresh_tried = false;
+    for (i32 r = ALLOCATABLE_BEGIN; r < ALLOCATABLE_END; r++) {
+      if (busy >> r & 1u) {
+        continue;
+      }
+      if (!(used >> r & 1u) && !(special >> r & 1u)) {
+        if (fresh_tried) {
+          continue;
+        }
+        fresh_tried = true;
+      }
+      choices.push_back({move_cost(v, r), r});
+    }
+    choices.push_back({spill_cost[v] + move_cost(v, SPILLED), SPILLED});
+    std::stable_sort(choices.begin(), choices.end());
+    for (auto [delta, r] : choices) {
+      assign[v] = r;
+      search(k + 1, cost + delta, r == SPILLED ? used : used | 1u << r);
+    }
+    assign[v] = UNASSIGNED;
+  }
+};
+
+// 结果优于启发式分配时替换 intervals.reg 和 spilled_nodes
+static void exact_allocate(const std::vector<MachineBB *> &dfs, const MachineCFG &cfg,
+                           const std::map<MachineOperand, i32> &interval_id,
+                           const std::vector<MachineOperand> &interval_oper, i32 first_spill_vreg,
+                           const IntervalHints &hints, IntervalSoA &intervals,
+                           std::set<MachineOperand> &spilled_nodes, std::chrono::steady_clock::time_point deadline) {
+  MemoryPhase phase(Phase::Interference);
+  InterferenceGraph g;
+  build_interference(dfs, interval_id, nullptr, g);  // 只用于小函数
+  ExactSolver solver(g);
+  for (i32 v = 0; v < g.n; v++) {
+    solver.special |= g.forbid[v];
+    // same 偏好当作一条不在循环中的 move，双向的偏好只算一次
+    i32 same = hints.same[v];
+    if (same != -1 && same != v && (hints.same[same] != v || v < same)) {
+      solver.moves[v].push_back({same, MOVE_CYCLES});
+      solver.moves[same].push_back({v, MOVE_CYCLES});
+    }
+    if (hints.reg[v] != -1) {
+      solver.prefer[v] = hints.reg[v];
+      solver.special |= 1u << hints.reg[v];
+    }
+  }
+  for (auto bb : dfs) {
+    i64 w = block_weight(cfg, bb);
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_def_use(inst);
+      for (auto &d : def) {
+        auto it = interval_id.find(d);
+        if (it != interval_id.end()) {
+          solver.spill_cost[it->second] += STORE_CYCLES * w;
+        }
+      }
+      for (auto &u : use) {
+        auto it = interval_id.find(u);
+        if (it != interval_id.end()) {
+          solver.spill_cost[it->second] += LOAD_CYCLES * w;
+        }
+      }
+      if (auto src = plain_move_src(inst)) {
+        auto a = interval_id.find(dyn_cast<MIMove>(inst)->dst);
+        auto b = interval_id.find(*src);
+        if (a != interval_id.end() && b != interval_id.end() && a->second != b->second) {
+          solver.moves[a->second].push_back({b->second, MOVE_CYCLES * w});
+          solver.moves[b->second].push_back({a->second, MOVE_CYCLES * w});
+        }
+      }
+    }
+  }
+  for (i32 v = 0; v < g.n; v++) {
+    if (interval_oper[v].value >= first_spill_vreg) {
+      solver.spill_cost[v] = SPILL_TEMP_COST;
+    }
+  }
+
+  std::vector<i32> incumbent(g.n);
+  for (i32 v = 0; v < g.n; v++) {
+    incumbent[v] = intervals.reg[v] == -1 ? ExactSolver::SPILLED : intervals.reg[v];
+  }
+  i64 heuristic_cost = solver.evaluate(incumbent);
+  if (heuristic_cost != INFINITE_COST) {
+    solver.best = incumbent;
+    solver.best_cost = heuristic_cost;
+  }
+
+  // 溢出代价高的先决定
+  solver.order.resize(g.n);
+  for (i32 v = 0; v < g.n; v++) {
+    solver.order[v] = v;
+  }
+  std::stable_sort(solver.order.begin(), solver.order.end(),
+                   [&](i32 a, i32 b) { return solver.spill_cost[a] > solver.spill_cost[b]; });
+  solver.deadline = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(EXACT_TIME_LIMIT_MS));
+  solver.search(0, 0, 0);
+
+  auto report = "Exact allocation: heuristic cost " + std::to_string(heuristic_cost) + ", best cost " +
+                std::to_string(solver.best_cost) + (solver.timeout ? " (timeout)" : " (optimal)");
+  dbg(report);
+  if (solver.best_cost >= heuristic_cost) {
+    return;
+  }
+  spilled_nodes.clear();
+  for (i32 v = 0; v < g.n; v++) {
+    if (solver.best[v] == ExactSolver::SPILLED) {
+      intervals.reg[v] = -1;
+      spilled_nodes.insert(interval_oper[v]);
+    } else {
+      intervals.reg[v] = solver.best[v];
+    }
+  }
+}
+#endif
+
+/********************************
+ * 乐观合并 (Park & Moon)
+ * 分配之前把所有不冲突的 move 两端合并为同一个 vreg（改写操作数，move 变成 mov v, v），
+ * 频率高的 move 先合并。合并后的 vreg 被溢出时不做 spill，而是拆回原来的 vreg 重新分配 (undo)。
+ * 分配完成后删除两端为同一个寄存器的 move
+ */
+#define OPTIMISTIC_COALESCING
+
+struct Coalescing {
+  // 合并后的 vreg -> 被改写的操作数及其原来的 vreg
+  std::map<MachineOperand, std::vector<std::pair<MachineOperand *, i32>>> renamed;
+};
+
+static void coalesce_moves(MachineFunc *f, const MachineCFG &cfg, WorkerPool *pool, RegisterConstraints &rc,
+                           Coalescing &c) {
+  std::vector<MachineBB *> bbs;
+  std::map<MachineOperand, i32> id;
+  std::vector<MachineOperand> oper;
+  std::vector<std::tuple<i64, i32, i32>> moves;  // (权重, dst, src)
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    bbs.push_back(bb);
+    i64 w = block_weight(cfg, bb);
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_def_use(inst);
+      def.insert(def.end(), use.begin(), use.end());
+      for (auto &o : def) {
+        if (o.state == MachineOperand::State::Virtual && id.insert({o, (i32)oper.size()}).second) {
+          oper.push_back(o);
+        }
+      }
+      if (auto src = plain_move_src(inst)) {
+        auto &dst = dyn_cast<MIMove>(inst)->dst;
+        if (dst.state == MachineOperand::State::Virtual && dst != *src) {
+          moves.push_back({w, id[dst], id[*src]});
+        }
+      }
+    }
+  }
+  if (moves.empty()) {
+    return;
+  }
+
+  InterferenceGraph g;
+  build_interference(bbs, id, pool, g);
+  // 合并组的代表保存组内所有 vreg 的邻居和成员
+  std::vector<i32> parent(g.n);
+  std::vector<u64> members((size_t)g.n * g.words, 0);
+  for (i32 v = 0; v < g.n; v++) {
+    parent[v] = v;
+    members[(size_t)v * g.words + v / 64] |= 1ull << (v % 64);
+  }
+  auto find = [&](i32 v) {
+    while (parent[v] != v) {
+      v = parent[v] = parent[parent[v]];
+    }
+    return v;
+  };
+  std::stable_sort(moves.begin(), moves.end(), [](auto &a, auto &b) { return std::get<0>(a) > std::get<0>(b); });
+  i32 coalesced = 0;
+  for (auto [w, a, b] : moves) {
+    a = find(a);
+    b = find(b);
+    if (a == b) {
+      continue;
+    }
+    u64 *row_a = &g.bits[(size_t)a * g.words], *row_b = &g.bits[(size_t)b * g.words];
+    u64 *mem_a = &members[(size_t)a * g.words], *mem_b = &members[(size_t)b * g.words];
+    bool conflict = false;
+    for (i32 k = 0; k < g.words && !conflict; k++) {
+      conflict = (row_a[k] & mem_b[k]) != 0;
+    }
+    if (conflict) {
+      continue;
+    }
+    for (i32 k = 0; k < g.words; k++) {
+      row_a[k] |= row_b[k];
+      mem_a[k] |= mem_b[k];
+    }
+    parent[b] = a;
+    coalesced++;
+  }
+
+  for (auto bb : bbs) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_defs_use_ptr(inst);
+      use.insert(use.end(), def.begin(), def.end());
+      for (MachineOperand *o : use) {
+        auto it = id.find(*o);
+        if (it == id.end()) {
+          continue;
+        }
+        i32 root = find(it->second);
+        if (root != it->second) {
+          c.renamed[oper[root]].push_back({o, o->value});
+          o->value = oper[root].value;
+        }
+      }
+    }
+  }
+  // 合并后的 vreg 继承组内 vreg 的寄存器偏好
+  auto &hints = rc.hints;
+  for (i32 v = 0; v < g.n; v++) {
+    i32 root = find(v);
+    auto it = hints.find(oper[v]);
+    if (root != v && it != hints.end() && hints.count(oper[root]) == 0) {
+      hints[oper[root]] = it->second;
+    }
+  }
+  auto report = "Coalesced " + std::to_string(coalesced) + " of " + std::to_string(moves.size()) + " moves";
+  dbg(report);
+}
+
+// 被溢出的合并 vreg 拆回原来的 vreg，有拆分时返回 true
+static bool undo_spilled_coalescing(Coalescing &c, std::set<MachineOperand> &spilled_nodes) {
+  bool undone = false;
+  for (auto &n : spilled_nodes) {
+    auto it = c.renamed.find(n);
+    if (it == c.renamed.end()) {
+      continue;
+    }
+    auto undo = "Uncoalescing v" + std::to_string(n.value);
+    dbg(undo);
+    for (auto [o, value] : it->second) {
+      o->value = value;
+    }
+    c.renamed.erase(it);
+    undone = true;
+  }
+  return undone;
+}
+
+static void remove_identity_moves(MachineFunc *f) {
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst;) {
+      auto next = inst->next;
+      auto x = dyn_cast<MIMove>(inst);
+      if (x != nullptr && x->shift.is_none() && is_physical(x->dst) && is_physical(x->rhs) &&
+          x->dst.value == x->rhs.value) {
+        bb->insts.remove(inst);
+      }
+      inst = next;
+    }
+  }
+}
+
+/********************************
+ * 重新计算 (rematerialization)
+ * const 全局数组的元素不会改变：vreg 只有一个定值 ldr v, [a, offset]，a 只由 const 全局变量的 MIGlobal 定值，
+ * offset 为立即数或只由 mov 立即数定值时，溢出 v 不需要栈槽，删除原来的 load，在每次使用前重新 load。
+ * 重新生成 MIGlobal 要 3 ~ 4 条指令，比从栈上 load 贵，所以只在 a 在每次使用处本来就活跃（且没有被溢出）时才做，
+ * 这时每次使用只需要一条 ldr，还省掉了 store 和栈槽
+ */
+struct Remat {
+  MILoad *load;
+  std::optional<MachineOperand> offset_imm;  // offset 为寄存器时它的值
+};
+
+static std::map<MachineOperand, std::vector<MachineInst *>> def_sites(MachineFunc *f) {
+  std::map<MachineOperand, std::vector<MachineInst *>> sites;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_def_use(inst);
+      for (auto &d : def) {
+        sites[d].push_back(inst);
+      }
+    }
+  }
+  return sites;
+}
+
+// vreg 只有一个定值时返回它
+static MachineInst *single_def(const std::map<MachineOperand, std::vector<MachineInst *>> &defs,
+                               const MachineOperand &o) {
+  auto it = defs.find(o);
+  return it != defs.end() && it->second.size() == 1 ? it->second[0] : nullptr;
+}
+
+// o 在 inst 之前活跃时返回 true，块的 liveout 需要是最新的
+static bool live_before(MachineInst *inst, const MachineOperand &o) {
+  bool live = inst->bb->liveout.count(o);
+  for (auto cur = inst->bb->insts.tail;; cur = cur->prev) {
+    auto [def, use] = get_def_use(cur);
+    if (std::find(def.begin(), def.end(), o) != def.end()) {
+      live = false;
+    }
+    if (std::find(use.begin(), use.end(), o) != use.end()) {
+      live = true;
+    }
+    if (cur == inst) {
+      return live;
+    }
+  }
+}
+
+static std::optional<Remat> find_remat(MachineFunc *f, const std::map<MachineOperand, std::vector<MachineInst *>> &defs,
+                                       const MachineOperand &n, const std::set<MachineOperand> &spilled_nodes) {
+  auto def = single_def(defs, n);
+  auto load = def ? dyn_cast<MILoad>(def) : nullptr;
+  if (load == nullptr || load->mode != MIAccess::Mode::Offset || load->addr.state != MachineOperand::State::Virtual ||
+      spilled_nodes.count(load->addr)) {
+    return std::nullopt;
+  }
+  auto addr_def = single_def(defs, load->addr);
+  auto global = addr_def ? dyn_cast<MIGlobal>(addr_def) : nullptr;
+  if (global == nullptr || !global->sym->is_const || !global->sym->is_glob) {
+    return std::nullopt;
+  }
+  Remat remat{load, std::nullopt};
+  if (load->offset.state == MachineOperand::State::Virtual) {
+    auto offset_def = single_def(defs, load->offset);
+    auto mv = offset_def ? dyn_cast<MIMove>(offset_def) : nullptr;
+    if (mv == nullptr || mv->cond != ArmCond::Any || !mv->shift.is_none() ||
+        mv->rhs.state != MachineOperand::State::Immediate) {
+      return std::nullopt;
+    }
+    remat.offset_imm = mv->rhs;
+  } else if (load->offset.state != MachineOperand::State::Immediate) {
+    return std::nullopt;
+  }
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_def_use(inst);
+      if (inst != load && std::find(use.begin(), use.end(), n) != use.end() && !live_before(inst, load->addr)) {
+        return std::nullopt;
+      }
+    }
+  }
+  return remat;
+}
+
+static void rematerialize(MachineFunc *f, const MachineOperand &n, const Remat &remat) {
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      if (inst == remat.load) {
+        continue;
+      }
+      auto [def, use] = get_def_use_ptr(inst);
+      i32 vreg = -1;
+      for (auto &u : use) {
+        if (*u == n) {
+          if (vreg == -1) {
+            vreg = f->virtual_max++;
+          }
+          u->value = vreg;
+        }
+      }
+      if (vreg == -1) {
+        continue;
+      }
+      auto load_inst = new MILoad(inst);
+      load_inst->bb = bb;
+      load_inst->addr = remat.load->addr;
+      load_inst->shift = remat.load->shift;
+      load_inst->offset = remat.load->offset;
+      // offset 寄存器不一定活跃到这里：ldr 的 imm12 放得下时直接用立即数，否则重新 mov
+      if (remat.offset_imm && remat.load->shift == 0 && remat.offset_imm->value >= 0 &&
+          remat.offset_imm->value < (1 << 12)) {
+        load_inst->offset = *remat.offset_imm;
+      } else if (remat.offset_imm) {
+        auto mv_inst = new MIMove(load_inst);
+        mv_inst->bb = bb;
+        mv_inst->rhs = *remat.offset_imm;
+        mv_inst->dst = MachineOperand::V(f->virtual_max++);
+        load_inst->offset = mv_inst->dst;
+      }
+      load_inst->dst = MachineOperand::V(vreg);
+    }
+  }
+  remat.load->bb->insts.remove(remat.load);
+}
+
+/********************************
+ * if-conversion
+ * 两臂都只有一个块、且只含少量 mov / 不影响标志位的运算指令的 if/else（或只有一臂的 if），
+ * 把两臂并入分支所在的块并改为条件执行：mov 直接加上条件，运算指令没有条件码，
+ * 先无条件算到新的 vreg 中，再用条件 mov 写回。两臂的条件互斥，所以先后顺序无关。
+ * 条件 mov 同时读 dst，只有汇合处活跃的值需要条件写，否则 dst 会一直活跃到函数入口：
+ * 臂内的临时值直接无条件计算；菱形中两臂都写的值，前一臂无条件写，后一臂的条件写覆盖它
+ */
+#define IF_CONVERSION
+
+constexpr int IF_CONVERT_MAX_INSTS = 4;
+
+static bool if_convertible(MachineBB *bb, MachineBB *join) {
+  if (bb->succ[0] != join || bb->succ[1] != nullptr) {
+    return false;
+  }
+  i32 count = 0;
+  for (auto inst = bb->insts.head; inst; inst = inst->next) {
+    if (auto x = dyn_cast<MIMove>(inst)) {
+      if (x->cond != ArmCond::Any) {
+        return false;
+      }
+    } else if (auto x = dyn_cast<MIBinary>(inst)) {
+      // 比较类的 MIBinary 会改写标志位，除法可能有副作用
+      if (x->tag != MachineInst::Tag::Add && x->tag != MachineInst::Tag::Sub && x->tag != MachineInst::Tag::Rsb &&
+          x->tag != MachineInst::Tag::Mul && x->tag != MachineInst::Tag::And && x->tag != MachineInst::Tag::Or) {
+        return false;
+      }
+    } else if (!(isa<MIJump>(inst) && inst == bb->insts.tail)) {
+      return false;
+    }
+    count++;
+  }
+  return count <= IF_CONVERT_MAX_INSTS;
+}
+
+// 把 bb 的指令按条件 cond 移到 head 的末尾，写 free 中的 vreg 的指令不加条件
+static void predicate_into(MachineFunc *f, MachineBB *head, MachineBB *bb, ArmCond cond,
+                           const std::set<MachineOperand> &free) {
+  for (auto inst = bb->insts.head; inst;) {
+    auto next = inst->next;
+    bb->insts.remove(inst);
+    if (isa<MIJump>(inst)) {
+      inst = next;
+      continue;
+    }
+    head->insts.insertAtEnd(inst);
+    inst->bb = head;
+    auto [def, use] = get_def_use(inst);
+    if (def.size() == 1 && free.count(def[0])) {
+      inst = next;
+      continue;
+    }
+    if (auto x = dyn_cast<MIMove>(inst)) {
+      x->cond = cond;
+    } else if (auto x = dyn_cast<MIBinary>(inst)) {
+      auto mv = new MIMove(head);
+      mv->cond = cond;
+      mv->dst = x->dst;
+      x->dst = MachineOperand::V(f->virtual_max++);
+      mv->rhs = x->dst;
+    }
+    inst = next;
+  }
+}
+
+static void if_convert(MachineFunc *f, WorkerPool *pool) {
+  // 合并只在原来的两条路径上加条件，不改变任何块入口处活跃的值，livein 一直有效
+  liveness_analysis(f, pool);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    std::map<MachineBB *, i32> preds;
+    for (auto bb = f->bb.head; bb; bb = bb->next) {
+      for (auto s : bb->succ) {
+        if (s != nullptr) {
+          preds[s]++;
+        }
+      }
+    }
+    for (auto head = f->bb.head; head; head = head->next) {
+      // head 以 b<cond> taken 结尾，另一个后继为 fall（可能还有一条 b fall）
+      auto last = head->insts.tail;
+      MIJump *jump = nullptr;
+      if (last && isa<MIJump>(last)) {
+        jump = dyn_cast<MIJump>(last);
+        last = last->prev;
+      }
+      auto br = last ? dyn_cast<MIBranch>(last) : nullptr;
+      if (br == nullptr || br->cond == ArmCond::Any || head->succ[0] == nullptr || head->succ[1] == nullptr) {
+        continue;
+      }
+      MachineBB *taken = br->target;
+      MachineBB *fall = head->succ[0] == taken ? head->succ[1] : head->succ[0];
+      if (taken == fall || taken == head || fall == head) {
+        continue;
+      }
+      // 菱形：两臂汇合到同一个块；三角形：一臂就是汇合块
+      MachineBB *join = nullptr;
+      std::vector<std::pair<MachineBB *, ArmCond>> arms;
+      if (fall->succ[0] == taken && fall->succ[1] == nullptr) {
+        join = taken;
+        arms = {{fall, opposite_cond(br->cond)}};
+      } else if (taken->succ[0] == fall && taken->succ[1] == nullptr) {
+        join = fall;
+        arms = {{taken, br->cond}};
+      } else if (taken->succ[0] != nullptr && taken->succ[0] == fall->succ[0]) {
+        join = taken->succ[0];
+        arms = {{taken, br->cond}, {fall, opposite_cond(br->cond)}};
+      } else {
+        continue;
+      }
+      bool ok = join != head;
+      for (auto [bb, cond] : arms) {
+        ok = ok && bb != f->bb.head && preds[bb] == 1 && if_convertible(bb, join);
+      }
+      if (!ok) {
+        continue;
+      }
+
+      // 每一臂读到的臂外的值（exposed）和写的值
+      std::vector<std::set<MachineOperand>> exposed(arms.size()), written(arms.size());
+      for (size_t i = 0; i < arms.size(); i++) {
+        for (auto inst = arms[i].first->insts.head; inst; inst = inst->next) {
+          auto [def, use] = get_def_use(inst);
+          for (auto &u : use) {
+            if (!written[i].count(u)) {
+              exposed[i].insert(u);
+            }
+          }
+          written[i].insert(def.begin(), def.end());
+        }
+      }
+      head->insts.remove(br);
+      if (jump != nullptr) {
+        head->insts.remove(jump);
+      }
+      for (size_t i = 0; i < arms.size(); i++) {
+        // 后一臂没有读到它、且汇合处不需要它或者后一臂会覆盖它时，可以无条件写
+        std::set<MachineOperand> free;
+        for (auto &v : written[i]) {
+          bool later_reads = false, later_writes = false;
+          for (size_t j = i + 1; j < arms.size(); j++) {
+            later_reads = later_reads || exposed[j].count(v);
+            later_writes = later_writes || written[j].count(v);
+          }
+          if (v.state == MachineOperand::State::Virtual && !later_reads &&
+              (!join->livein.count(v) || later_writes)) {
+            free.insert(v);
+          }
+        }
+        predicate_into(f, head, arms[i].first, arms[i].second, free);
+        f->bb.remove(arms[i].first);
+      }
+      head->succ = {join, nullptr};
+      if (head->next != join) {
+        new MIJump(join, head);
+      }
+      dbg("If-converted a branch");
+      invalidate_machine_cfg(f);
+      changed = true;
+      break;
+    }
+  }
+}
+
+/********************************
+ * 基本块布局
+ * 边的权重为块频率乘以分支概率。按权重从大到小把边串成链 (Pettis-Hansen)，回边不参与，
+ * 之后从入口所在的链开始，每次接上与已放置的块相连的边中权重最大的链，没有时按原来的顺序。
+ * 热路径上的分支都变成 fall-through，循环体连续排列。
+ * 重排 f->bb 后修正每个块末尾的跳转，线性扫描也使用这个顺序
+ */
+#define BLOCK_PLACEMENT
+
+// 块的 fall-through 后继：条件分支之外的那个后继，或者没有跳转时的唯一后继
+static MachineBB *fall_through_succ(MachineBB *bb) {
+  auto last = bb->insts.tail;
+  if (last && isa<MIJump>(last)) {
+    last = last->prev;
+    auto br = last ? dyn_cast<MIBranch>(last) : nullptr;
+    return br == nullptr ? nullptr : dyn_cast<MIJump>(bb->insts.tail)->target;
+  }
+  if (last && isa<MIReturn>(last)) {
+    return nullptr;
+  }
+  if (auto br = last ? dyn_cast<MIBranch>(last) : nullptr) {
+    return bb->succ[0] == br->target ? bb->succ[1] : bb->succ[0];
+  }
+  return bb->succ[0];
+}
+
+static void place_blocks(MachineFunc *f, const MachineCFG &cfg) {
+  std::vector<MachineBB *> blocks;
+  std::map<MachineBB *, i32> index;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    index[bb] = blocks.size();
+    blocks.push_back(bb);
+  }
+  i32 n = blocks.size();
+
+  // 回边：DFS 中指向栈上祖先的边
+  std::set<std::pair<i32, i32>> back_edges;
+  std::vector<i32> state(n, 0);  // 0 未访问，1 在栈上，2 已完成
+  std::vector<std::pair<i32, i32>> stack{{0, 0}};
+  state[0] = 1;
+  while (!stack.empty()) {
+    auto &[b, k] = stack.back();
+    if (k == 2) {
+      state[b] = 2;
+      stack.pop_back();
+      continue;
+    }
+    auto s = blocks[b]->succ[k++];
+    if (s == nullptr) {
+      continue;
+    }
+    i32 t = index[s];
+    if (state[t] == 1) {
+      back_edges.insert({b, t});
+    } else if (state[t] == 0) {
+      state[t] = 1;
+      stack.push_back({t, 0});
+    }
+  }
+
+  struct Edge {
+    double weight;
+    i32 from, to;
+  };
+  std::vector<Edge> edges;
+  for (i32 b = 0; b < n; b++) {
+    for (auto s : blocks[b]->succ) {
+      if (s != nullptr && !back_edges.count({b, index[s]})) {
+        double w = cfg.frequency(blocks[b]) * cfg.probability(blocks[b], s);
+        edges.push_back({w, b, index[s]});
+      }
+    }
+  }
+  std::stable_sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) { return a.weight > b.weight; });
+
+  // 链用 next_in_chain 串起来，chain_of 为所在链的链首
+  std::vector<i32> next_in_chain(n, -1), chain_of(n), chain_tail(n);
+  for (i32 b = 0; b < n; b++) {
+    chain_of[b] = chain_tail[b] = b;
+  }
+  for (auto &e : edges) {
+    i32 a = chain_of[e.from], b = chain_of[e.to];
+    if (a == b || chain_tail[a] != e.from || b != e.to || e.to == 0) {
+      continue;
+    }
+    next_in_chain[e.from] = e.to;
+    chain_tail[a] = chain_tail[b];
+    for (i32 k = b; k != -1; k = next_in_chain[k]) {
+      chain_of[k] = a;
+    }
+  }
+
+  std::vector<i32> order;
+  std::vector<bool> placed(n, false);
+  for (i32 c = 0; c != -1;) {
+    for (i32 k = c; k != -1; k = next_in_chain[k]) {
+      order.push_back(k);
+      placed[k] = true;
+    }
+    c = -1;
+    for (auto &e : edges) {
+      if (placed[e.from] && !placed[e.to]) {
+        c = chain_of[e.to];
+        break;
+      }
+    }
+    for (i32 b = 0; b < n && c == -1; b++) {
+      if (!placed[b] && chain_of[b] == b) {
+        c = b;
+      }
+    }
+  }
+
+  // 按新的顺序修正末尾的跳转
+  for (i32 i = 0; i < n; i++) {
+    auto bb = blocks[order[i]];
+    auto next = i + 1 < n ? blocks[order[i + 1]] : nullptr;
+    auto fall = fall_through_succ(bb);
+    if (bb->insts.tail && isa<MIJump>(bb->insts.tail) && fall != nullptr) {
+      bb->insts.remove(bb->insts.tail);
+    }
+    auto last = bb->insts.tail;
+    if (last && isa<MIJump>(last)) {
+      if (dyn_cast<MIJump>(last)->target == next) {
+        bb->insts.remove(last);
+      }
+      continue;
+    }
+    auto br = last ? dyn_cast<MIBranch>(last) : nullptr;
+    if (br != nullptr && br->cond != ArmCond::Any && br->target == next && fall != nullptr) {
+      br->cond = opposite_cond(br->cond);
+      br->target = fall;
+      fall = next;
+    }
+    if (fall != nullptr && fall != next) {
+      new MIJump(fall, bb);
+    }
+  }
+
+  for (auto bb : blocks) {
+    f->bb.remove(bb);
+  }
+  for (i32 b : order) {
+    f->bb.insertAtEnd(blocks[b]);
+  }
+}
+
+/********************************
+ * 边操作
+ * 新块插在前驱之后（原来就是 fall-through 时），或者插在一个没有 fall-through 进入的位置之前，
+ * 否则放在函数末尾用跳转回到后继。机器级 CFG 缓存存在时增量更新
+ */
+
+// bb 执行完后顺序落到布局上的下一个块
+static bool falls_into_next(MachineBB *bb) {
+  auto last = bb->insts.tail;
+  return last == nullptr || !(isa<MIJump>(last) || isa<MIReturn>(last));
+}
+
+// 块末尾的跳转（分支、跳转、返回）中的第一条，没有时返回 nullptr
+static MachineInst *terminator_begin(MachineBB *bb) {
+  MachineInst *ret = nullptr;
+  for (auto inst = bb->insts.tail; inst && (isa<MIBranch>(inst) || isa<MIJump>(inst) || isa<MIReturn>(inst));
+       inst = inst->prev) {
+    ret = inst;
+  }
+  return ret;
+}
+
+// 把 bb 中指向 from 的跳转和后继改为 to
+static void retarget(MachineBB *bb, MachineBB *from, MachineBB *to) {
+  for (auto inst = bb->insts.head; inst; inst = inst->next) {
+    if (auto x = dyn_cast<MIBranch>(inst)) {
+      if (x->target == from) {
+        x->target = to;
+      }
+    } else if (auto x = dyn_cast<MIJump>(inst)) {
+      if (x->target == from) {
+        x->target = to;
+      }
+    }
+  }
+  for (auto &s : bb->succ) {
+    if (s == from) {
+      s = to;
+    }
+  }
+}
+
+MachineBB *split_edge(MachineFunc *f, MachineBB *pred, MachineBB *succ) {
+  auto bb = new MachineBB(succ->bb);
+  bool fall = pred->next == succ && falls_into_next(pred);
+  retarget(pred, succ, bb);
+  bb->succ = {succ, nullptr};
+  if (fall) {
+    f->bb.insertAfter(bb, pred);
+  } else if (succ->prev != nullptr && !falls_into_next(succ->prev)) {
+    f->bb.insertBefore(bb, succ);
+  } else {
+    f->bb.insertAtEnd(bb);
+    new MIJump(succ, bb);
+  }
+  auto it = machine_cfg_cache.find(f);
+  if (it != machine_cfg_cache.end()) {
+    it->second->insert_on_edge(bb, pred, succ);
+  }
+  return bb;
+}
+
+std::vector<MIMove *> insert_edge_moves(MachineFunc *f, MachineBB *pred, MachineBB *succ,
+                                       const std::vector<std::pair<MachineOperand, MachineOperand>> &moves) {
+  // 只有一个后继时放在前驱末尾的跳转之前（mov 不影响标志位），只有一个前驱时放在后继开头，否则拆分边
+  auto &cfg = machine_cfg(f);
+  MachineBB *bb;
+  MachineInst *before;
+  if (pred->succ[1] == nullptr || pred->succ[0] == pred->succ[1]) {
+    bb = pred;
+    before = terminator_begin(pred);
+  } else if (cfg.preds[succ].size() == 1) {
+    bb = succ;
+    before = succ->insts.head;
+  } else {
+    bb = split_edge(f, pred, succ);
+    before = bb->insts.head;
+  }
+  std::vector<MIMove *> emitted;
+  auto emit = [&](const MachineOperand &dst, const MachineOperand &src) {
+    auto mv = before ? new MIMove(before) : new MIMove(bb);
+    mv->bb = bb;
+    mv->dst = dst;
+    mv->rhs = src;
+    emitted.push_back(mv);
+  };
+
+  // 顺序化：先发出目标不再被其他 move 读取的，只剩环时用新的 vreg 打断一个
+  std::vector<std::pair<MachineOperand, MachineOperand>> pending;
+  for (auto &[dst, src] : moves) {
+    if (dst != src) {
+      pending.push_back({dst, src});
+    }
+  }
+  while (!pending.empty()) {
+    bool progress = false;
+    for (size_t i = 0; i < pending.size(); i++) {
+      auto dst = pending[i].first;
+      bool read = false;
+      for (size_t j = 0; j < pending.size() && !read; j++) {
+        read = j != i && pending[j].second == dst;
+      }
+      if (!read) {
+        emit(dst, pending[i].second);
+        pending.erase(pending.begin() + i);
+        progress = true;
+        break;
+      }
+    }
+    if (!progress) {
+      auto tmp = MachineOperand::V(f->virtual_max++);
+      emit(tmp, pending[0].second);
+      pending[0].second = tmp;
+    }
+  }
+  return emitted;
+}
+
+void fold_empty_blocks(MachineFunc *f) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto bb = f->bb.head->next; bb; bb = bb->next) {
+      auto target = bb->succ[0];
+      bool empty = bb->insts.head == nullptr || (bb->insts.head == bb->insts.tail && isa<MIJump>(bb->insts.head));
+      if (!empty || target == nullptr || target == bb || bb->succ[1] != nullptr) {
+        continue;
+      }
+      for (auto p = f->bb.head; p; p = p->next) {
+        if (p == bb) {
+          continue;
+        }
+        retarget(p, bb, target);
+        // 原来顺序落到 bb 的块，删除 bb 之后要跳到 target
+        if (p->next == bb && falls_into_next(p) && bb->next != target) {
+          new MIJump(target, p);
+        }
+      }
+      f->bb.remove(bb);
+      invalidate_machine_cfg(f);
+      dbg("Folded an empty block");
+      changed = true;
+      break;
+    }
+  }
+}
+
+/********************************
+ * 定值下沉
+ * 没有副作用、只有一个定值的 MIGlobal、mov 立即数和不影响标志位的运算，
+ * 在块内移到第一次使用之前；块内不再使用时，如果只有一个后继用到它、且这个后继只有一个前驱并且不在更深的循环中，
+ * 移到后继的开头。运算指令跨块时要求源操作数本来就在后继入口活跃，不延长它们的区间，移动后就地更新两个块的活跃集合
+ */
+#define SINK_DEFINITIONS
+
+static bool sinkable(MachineInst *inst) {
+  if (isa<MIGlobal>(inst)) {
+    return true;
+  }
+  if (auto x = dyn_cast<MIMove>(inst)) {
+    return x->cond == ArmCond::Any && x->shift.is_none() && x->rhs.state == MachineOperand::State::Immediate;
+  }
+  if (auto x = dyn_cast<MIBinary>(inst)) {
+    return x->tag == MachineInst::Tag::Add || x->tag == MachineInst::Tag::Sub || x->tag == MachineInst::Tag::Rsb ||
+           x->tag == MachineInst::Tag::Mul || x->tag == MachineInst::Tag::And || x->tag == MachineInst::Tag::Or;
+  }
+  return false;
+}
+
+static void sink_definitions(MachineFunc *f, const MachineCFG &cfg, WorkerPool *pool) {
+  liveness_analysis(f, pool);
+  std::map<MachineOperand, i32> def_count;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_def_use(inst);
+      for (auto &d : def) {
+        def_count[d]++;
+      }
+    }
+  }
+
+  i32 sunk = 0;
+  for (auto bb : cfg.rpo) {
+    for (auto inst = bb->insts.tail; inst;) {
+      auto prev = inst->prev;
+      auto [def, use] = get_def_use(inst);
+      if (!sinkable(inst) || def.size() != 1 || def[0].state != MachineOperand::State::Virtual ||
+          def_count[def[0]] != 1) {
+        inst = prev;
+        continue;
+      }
+      auto dst = def[0];
+      std::vector<MachineOperand> srcs;
+      for (auto &u : use) {
+        if (u.state != MachineOperand::State::Immediate) {
+          srcs.push_back(u);
+        }
+      }
+      // 找到第一次使用，途中源操作数被改写时停在改写之前
+      MachineInst *pos = nullptr;
+      bool used = false;
+      for (auto cur = inst->next; cur; cur = cur->next) {
+        auto [cur_def, cur_use] = get_def_use(cur);
+        used = std::find(cur_use.begin(), cur_use.end(), dst) != cur_use.end();
+        bool clobber = false;
+        for (auto &d : cur_def) {
+          clobber = clobber || std::find(srcs.begin(), srcs.end(), d) != srcs.end();
+        }
+        if (used || clobber) {
+          pos = cur;
+          break;
+        }
+      }
+
+      if (pos != nullptr) {
+        if (pos != inst->next) {
+          bb->insts.remove(inst);
+          bb->insts.insertBefore(inst, pos);
+          sunk++;
+        }
+      } else {
+        MachineBB *target = nullptr;
+        i32 users = 0;
+        for (auto s : bb->succ) {
+          if (s != nullptr && s->livein.count(dst) && s != target) {
+            target = s;
+            users++;
+          }
+        }
+        bool srcs_live = target != nullptr && !bb->livein.count(dst);
+        for (auto &s : srcs) {
+          srcs_live = srcs_live && target->livein.count(s);
+        }
+        if (users == 1 && srcs_live && cfg.preds.at(target).size() == 1 && cfg.depth(target) <= cfg.depth(bb)) {
+          bb->insts.remove(inst);
+          if (target->insts.head) {
+            target->insts.insertBefore(inst, target->insts.head);
+          } else {
+            target->insts.insertAtEnd(inst);
+          }
+          inst->bb = target;
+          // 源操作数本来就活跃到 target 中，只有 dst 不再跨过这条边
+          bb->liveout.erase(dst);
+          target->livein.erase(dst);
+          sunk++;
+        }
+      }
+      inst = prev;
+    }
+  }
+  auto report = "Sunk " + std::to_string(sunk) + " definitions";
+  dbg(report);
+}
+
+/********************************
+ * 寻址方式折叠
+ * add t, b, i, lsl #k 之后的 ldr/str [t, #0] 改为 [b, i, lsl #k]，t 不再使用时删除 add。
+ * 循环中 [b, i, lsl #k] 的访问，b 为循环不变量、i 只在循环中每次加 1、且访问与加 1 在同一个块中访问在前时，
+ * 在 preheader 中计算 p = b + (i << k)，访问改为 [p]，访问之后 p 加上 1 << k。
+ * 分配之后 ldr/str [r] 与随后的 add r, r, #c 合并为后变址 [r], #c
+ */
+#define ADDRESS_MODE_FOLDING
+
+constexpr i32 POST_INDEX_MAX_OFFSET = 255;
+
+static bool is_shifted_add(MIBinary *x) {
+  return x->tag == MachineInst::Tag::Add && x->rhs.state != MachineOperand::State::Immediate &&
+         (x->shift.is_none() || x->shift.type == ArmShift::Lsl);
+}
+
+static void fold_address_modes(MachineFunc *f) {
+  auto defs = def_sites(f);
+  std::map<MachineOperand, i32> use_count;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_def_use(inst);
+      for (auto &u : use) {
+        use_count[u]++;
+      }
+    }
+  }
+
+  i32 folded = 0;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst;) {
+      auto next = inst->next;
+      auto x = dyn_cast<MIBinary>(inst);
+      if (x == nullptr || !is_shifted_add(x) || x->dst.state != MachineOperand::State::Virtual ||
+          defs[x->dst].size() != 1) {
+        inst = next;
+        continue;
+      }
+      // 向后找以 t 为地址的访问，b 或 i 被改写时停止
+      i32 uses = 0;
+      for (auto cur = inst->next; cur; cur = cur->next) {
+        auto access = dyn_cast<MIAccess>(cur);
+        if (access != nullptr && access->addr == x->dst && access->mode == MIAccess::Mode::Offset &&
+            access->offset.state == MachineOperand::State::Immediate && access->offset.value == 0 &&
+            !(isa<MIStore>(cur) && dyn_cast<MIStore>(cur)->data == x->dst)) {
+          access->addr = x->lhs;
+          access->offset = x->rhs;
+          access->shift = x->shift.is_none() ? 0 : x->shift.shift;
+          uses++;
+          folded++;
+        }
+        auto [cur_def, cur_use] = get_def_use(cur);
+        if (std::find(cur_def.begin(), cur_def.end(), x->lhs) != cur_def.end() ||
+            std::find(cur_def.begin(), cur_def.end(), x->rhs) != cur_def.end()) {
+          break;
+        }
+      }
+      if (uses > 0 && uses == use_count[x->dst]) {
+        bb->insts.remove(inst);
+      }
+      inst = next;
+    }
+  }
+  auto report = "Folded " + std::to_string(folded) + " address computations";
+  dbg(report);
+}
+
+static void reduce_address_ivs(MachineFunc *f, const MachineCFG &cfg) {
+  auto defs = def_sites(f);
+  // 每个指针都在整个循环中活跃，寄存器已经不够时不做
+  std::map<MachineBB *, i32> pressure;
+  for (auto &lp : estimate_register_pressure(f)) {
+    pressure[lp.header] = lp.max_live;
+  }
+  i32 reduced = 0;
+  for (auto &l : cfg.loops) {
+    // 唯一的循环外前驱，且只有 header 一个后继
+    MachineBB *preheader = nullptr;
+    i32 outside = 0;
+    for (auto p : cfg.preds.at(l->header)) {
+      if (!l->blocks.count(p)) {
+        preheader = p;
+        outside++;
+      }
+    }
+    if (outside != 1 || preheader->succ[1] != nullptr) {
+      continue;
+    }
+    auto in_loop = [&](const MachineOperand &o) {
+      for (auto inst : defs[o]) {
+        if (l->blocks.count(inst->bb)) {
+          return true;
+        }
+      }
+      return false;
+    };
+    for (auto bb : l->blocks) {
+      if (cfg.loop_of.at(bb) != l.get()) {
+        continue;
+      }
+      for (auto inst = bb->insts.head; inst; inst = inst->next) {
+        auto access = dyn_cast<MIAccess>(inst);
+        if (access == nullptr || access->mode != MIAccess::Mode::Offset ||
+            access->addr.state != MachineOperand::State::Virtual ||
+            access->offset.state != MachineOperand::State::Virtual || in_loop(access->addr)) {
+          continue;
+        }
+        auto i = access->offset;
+        // i 在循环中唯一的定值是同一块中访问之后的 add i, i, #1
+        MachineInst *inc = nullptr;
+        i32 loop_defs = 0;
+        for (auto d : defs[i]) {
+          if (l->blocks.count(d->bb)) {
+            inc = d;
+            loop_defs++;
+          }
+        }
+        auto x = loop_defs == 1 ? dyn_cast<MIBinary>(inc) : nullptr;
+        if (x == nullptr || x->tag != MachineInst::Tag::Add || x->dst != i || x->lhs != i || !x->shift.is_none() ||
+            x->rhs.state != MachineOperand::State::Immediate || x->rhs.value != 1 || x->bb != bb) {
+          continue;
+        }
+        bool before = false;
+        for (auto cur = inst->next; cur && !before; cur = cur->next) {
+          before = cur == inc;
+        }
+        i32 step = 1 << access->shift;
+        if (!before || step > POST_INDEX_MAX_OFFSET ||
+            pressure[l->header] >= ALLOCATABLE_END - ALLOCATABLE_BEGIN) {
+          continue;
+        }
+        for (auto outer = l.get(); outer; outer = outer->parent) {
+          pressure[outer->header]++;
+        }
+
+        auto p = MachineOperand::V(f->virtual_max++);
+        auto term = terminator_begin(preheader);
+        auto init = term ? new MIBinary(MachineInst::Tag::Add, term) : new MIBinary(MachineInst::Tag::Add, preheader);
+        init->bb = preheader;
+        init->dst = p;
+        init->lhs = access->addr;
+        init->rhs = i;
+        if (access->shift != 0) {
+          init->shift.type = ArmShift::Lsl;
+          init->shift.shift = access->shift;
+        }
+        access->addr = p;
+        access->offset = MachineOperand::I(0);
+        access->shift = 0;
+        auto step_inst = inst->next ? new MIBinary(MachineInst::Tag::Add, inst->next) : new MIBinary(MachineInst::Tag::Add, bb);
+        step_inst->bb = bb;
+        step_inst->dst = p;
+        step_inst->lhs = p;
+        step_inst->rhs = MachineOperand::I(step);
+        defs[p] = {init, step_inst};
+        reduced++;
+      }
+    }
+  }
+  auto report = "Strength-reduced " + std::to_string(reduced) + " array indices";
+  dbg(report);
+}
+
+// 分配之后：ldr/str [r] 与之后的 add r, r, #c 之间没有用到 r 时合并为 [r], #c
+static void fuse_post_increment(MachineFunc *f) {
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto access = dyn_cast<MIAccess>(inst);
+      if (access == nullptr || access->mode != MIAccess::Mode::Offset ||
+          access->offset.state != MachineOperand::State::Immediate || access->offset.value != 0 ||
+          access->addr.state != MachineOperand::State::Allocated) {
+        continue;
+      }
+      auto r = access->addr;
+      auto [def, use] = get_def_use(inst);
+      if (std::find(def.begin(), def.end(), r) != def.end() ||
+          (isa<MIStore>(inst) && dyn_cast<MIStore>(inst)->data == r)) {
+        continue;
+      }
+      for (auto cur = inst->next; cur; cur = cur->next) {
+        auto x = dyn_cast<MIBinary>(cur);
+        if (x != nullptr && x->tag == MachineInst::Tag::Add && x->dst == r && x->lhs == r && x->shift.is_none() &&
+            x->rhs.state == MachineOperand::State::Immediate && std::abs(x->rhs.value) <= POST_INDEX_MAX_OFFSET) {
+          access->mode = MIAccess::Mode::Postfix;
+          access->offset = x->rhs;
+          bb->insts.remove(cur);
+          break;
+        }
+        auto [cur_def, cur_use] = get_def_use(cur);
+        if (std::find(cur_def.begin(), cur_def.end(), r) != cur_def.end() ||
+            std::find(cur_use.begin(), cur_use.end(), r) != cur_use.end() || isa<MICall>(cur)) {
+          break;
+        }
+      }
+    }
+  }
+}
+
+/********************************
+ * 共享全局变量地址
+ * 每次访问全局变量都要用 MIGlobal 重新生成地址。同一个符号出现多次时，在所有出现位置的最近公共支配块中生成一次
+ * （块中本来就有出现时放在第一次出现处，否则放在块尾的跳转之前），之后的访问都使用这个 vreg。
+ * 共享的地址从这里到各个出现位置之间占一个寄存器，所以只在这些块的 MaxLive 都留有空闲寄存器时做，
+ * 块中有 call 时 ip 被破坏，少算一个；按出现次数从多到少选
+ */
+#define SHARE_GLOBAL_ADDRESS
+
+static void share_global_addresses(MachineFunc *f, const MachineCFG &cfg) {
+  std::map<Decl *, std::vector<MIGlobal *>> sites;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto x = dyn_cast<MIGlobal>(inst);
+      if (x && x->dst.state == MachineOperand::State::Virtual && cfg.idom.count(bb)) {
+        sites[x->sym].push_back(x);
+      }
+    }
+  }
+  std::vector<std::pair<Decl *, std::vector<MIGlobal *>>> order;
+  for (auto &[sym, s] : sites) {
+    if (s.size() > 1) {
+      order.push_back({sym, s});
     }
-    def.push_back(MachineOperand::R(ArmReg::lr));
-    def.push_back(MachineOperand::R(ArmReg::ip));
-  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
-    def = {x->dst};
-  } else if (isa<MIReturn>(inst)) {
-    // ret
-    use.push_back(MachineOperand::R(ArmReg::r0));
   }
-  return {def, use};
-}
+  std::stable_sort(order.begin(), order.end(),
+                   [](auto &a, auto &b) { return a.second.size() > b.second.size(); });
 
-// 返回一条机器指令需要使用和修改的寄存器的地址
-std::pair<MachineOperand *, std::vector<MachineOperand *>> get_def_use_ptr(MachineInst *inst) {
-  MachineOperand *def = nullptr;
-  std::vector<MachineOperand *> use;
+  // 最近公共支配块
+  auto common_dominator = [&](MachineBB *a, MachineBB *b) {
+    std::set<MachineBB *> up;
+    for (; a != nullptr; a = cfg.idom.at(a)) {
+      up.insert(a);
+    }
+    for (; !up.count(b); b = cfg.idom.at(b)) {
+    }
+    return b;
+  };
+  auto live = block_max_live(f);
+  constexpr i32 regs = ALLOCATABLE_END - ALLOCATABLE_BEGIN;
+  auto defs = def_sites(f);
+  std::map<MachineOperand, MachineOperand> renamed;
+  i32 shared = 0;
+  for (auto &[sym, s] : order) {
+    auto home = s[0]->bb;
+    for (auto site : s) {
+      home = common_dominator(home, site->bb);
+    }
+    // 地址活跃的块：home 支配的、能到达某个出现位置的块
+    std::set<MachineBB *> region{home};
+    std::vector<MachineBB *> work;
+    for (auto site : s) {
+      work.push_back(site->bb);
+    }
+    while (!work.empty()) {
+      auto bb = work.back();
+      work.pop_back();
+      if (region.insert(bb).second) {
+        for (auto p : cfg.preds.at(bb)) {
+          if (cfg.dominates(home, p)) {
+            work.push_back(p);
+          }
+        }
+      }
+    }
+    bool fits = true;
+    for (auto bb : region) {
+      fits = fits && live[bb] + has_call(bb) < regs;
+    }
+    if (!fits) {
+      continue;
+    }
+    for (auto bb : region) {
+      live[bb]++;
+    }
 
-  if (auto x = dyn_cast<MIBinary>(inst)) {
-    def = &x->dst;
-    use = {&x->lhs, &x->rhs};
-  } else if (auto x = dyn_cast<MILongMul>(inst)) {
-    def = &x->dst;
-    use = {&x->lhs, &x->rhs};
-  } else if (auto x = dyn_cast<MIFma>(inst)) {
-    def = {&x->dst};
-    use = {&x->dst, &x->lhs, &x->rhs, &x->acc};
-  } else if (auto x = dyn_cast<MIMove>(inst)) {
-    def = &x->dst;
-    use = {&x->rhs};
-  } else if (auto x = dyn_cast<MILoad>(inst)) {
-    def = &x->dst;
-    use = {&x->addr, &x->offset};
-  } else if (auto x = dyn_cast<MIStore>(inst)) {
-    use = {&x->data, &x->addr, &x->offset};
-  } else if (auto x = dyn_cast<MICompare>(inst)) {
-    use = {&x->lhs, &x->rhs};
-  } else if (isa<MICall>(inst)) {
-    // intentionally blank
-  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
-    def = {&x->dst};
+    MachineInst *pos = nullptr;
+    for (auto inst = home->insts.head; inst && !pos; inst = inst->next) {
+      if (std::find(s.begin(), s.end(), inst) != s.end()) {
+        pos = inst;
+      }
+    }
+    if (pos == nullptr) {
+      pos = terminator_begin(home);
+    }
+    auto base = MachineOperand::V(f->virtual_max++);
+    auto global_inst = pos ? new MIGlobal(sym, pos) : new MIGlobal(sym, home);
+    global_inst->bb = home;
+    global_inst->dst = base;
+    for (auto site : s) {
+      // 只有这一处定值时直接改名，否则保留一条 mov
+      if (defs[site->dst].size() == 1) {
+        renamed[site->dst] = base;
+      } else {
+        auto mv_inst = new MIMove(site);
+        mv_inst->bb = site->bb;
+        mv_inst->dst = site->dst;
+        mv_inst->rhs = base;
+      }
+      site->bb->insts.remove(site);
+    }
+    shared++;
   }
-  return {def, use};
+
+  for (auto bb = f->bb.head; bb && !renamed.empty(); bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_defs_use_ptr(inst);
+      for (auto u : use) {
+        auto it = renamed.find(*u);
+        if (it != renamed.end()) {
+          *u = it->second;
+        }
+      }
+    }
+  }
+  auto report = "Shared " + std::to_string(shared) + " global addresses";
+  dbg(report);
 }
 
 /********************************
- * 分析live-range
- */ 
-void liveness_analysis(MachineFunc *f) {
-  // calculate LiveUse and Def sets for each bb
-  // each elements is a virtual register or precolored register
+ * 分配时间预算
+ * 函数或整个程序的分配时间超出预算、或 spill 轮数过多时不再迭代，剩下的 vreg 全部放到栈上：
+ * 每条指令之前把用到的 vreg load 到此处空闲的寄存器，之后把 def store 回去。只需要扫描一遍，一定能完成。
+ * 除了每轮开始时，区间分配、精确分配和 spill 改写的过程中也检查预算，超出时放弃这一轮
+ */
+constexpr i32 FUNCTION_BUDGET_MS = 5000;
+constexpr i32 PROGRAM_BUDGET_MS = 30000;
+constexpr i32 MAX_SPILL_ROUNDS = 64;
+
+static void allocate_on_stack(MachineFunc *f) {
+  PhysicalLiveness live;
+  physical_liveness(f, live);
+  std::map<i32, i32> slot;  // vreg 到栈上的偏移
+  auto offset_of = [&](i32 v) {
+    auto [it, inserted] = slot.insert({v, f->stack_size + (i32)slot.size() * 4});
+    return it->second;
+  };
+  // ldr / str 只有 imm12，更大的偏移先 mov 到 scratch
+  auto set_offset = [](MIAccess *access, i32 offset, i32 scratch) {
+    if (offset < (1 << 12)) {
+      access->offset = MachineOperand::I(offset);
+    } else {
+      auto mv_inst = new MIMove(access);
+      mv_inst->bb = access->bb;
+      mv_inst->dst = allocated_reg(scratch);
+      mv_inst->rhs = MachineOperand::I(offset);
+      access->offset = mv_inst->dst;
+    }
+  };
+
   for (auto bb = f->bb.head; bb; bb = bb->next) {
-    bb->liveuse.clear();
-    bb->def.clear();
+    std::vector<MachineInst *> insts;
     for (auto inst = bb->insts.head; inst; inst = inst->next) {
-      auto [def, use] = get_def_use(inst);
+      insts.push_back(inst);
+    }
+    // after[i] 为 insts[i] 之后活跃的物理寄存器
+    std::vector<RegMask> after(insts.size());
+    RegMask cur = live.liveout[bb];
+    for (i32 i = (i32)insts.size() - 1; i >= 0; i--) {
+      after[i] = cur;
+      cur = step_liveness(insts[i], cur);
+    }
 
-      // liveuse
-      for (auto &u : use) {
-        if (u.needs_color() && bb->def.find(u) == bb->def.end()) {
-          bb->liveuse.insert(u);
+    for (i32 i = 0; i < insts.size(); i++) {
+      auto inst = insts[i];
+      auto [defs, uses] = get_defs_use_ptr(inst);
+      RegMask busy = after[i] | step_liveness(inst, after[i]);
+      for (auto ops : {&defs, &uses}) {
+        for (auto o : *ops) {
+          if (is_physical(*o) && o->value < 16) {
+            busy |= 1u << o->value;
+          }
         }
       }
-      // def
-      for (auto &d : def) {
-        if (d.needs_color() && bb->liveuse.find(d) == bb->liveuse.end()) {
-          bb->def.insert(d);
+      // 一条指令最多用到 4 个 vreg，正常不会用完；用完时继续只会覆盖活跃的值，直接报错
+      auto no_scratch = [&]() {
+        std::cerr << "error: register allocation of " << f->func->func->name
+                  << " ran out of scratch registers on the stack fallback" << std::endl;
+        std::abort();
+      };
+      auto scratch = [&]() {
+        for (i32 r = ALLOCATABLE_BEGIN; r < ALLOCATABLE_END; r++) {
+          if (!(busy >> r & 1u)) {
+            busy |= 1u << r;
+            return r;
+          }
         }
-      }
-    }
-    // initial values
-    bb->livein = bb->liveuse;
-    bb->liveout.clear();
-  }
+        no_scratch();
+        return -1;
+      };
 
-  // calculate LiveIn and LiveOut for each bb
-  bool changed = true;
-  while (changed) {
-    changed = false;
-    for (auto bb = f->bb.head; bb; bb = bb->next) {
-      std::set<MachineOperand> new_out;
-      for (auto &succ : bb->succ) {
-        if (succ) {
-          new_out.insert(succ->livein.begin(), succ->livein.end());
+      std::map<i32, i32> reg_of;
+      for (auto u : uses) {
+        if (u->state != MachineOperand::State::Virtual || reg_of.count(u->value)) {
+          continue;
         }
+        i32 r = scratch();
+        reg_of[u->value] = r;
+        auto load_inst = new MILoad(inst);
+        load_inst->bb = bb;
+        load_inst->addr = MachineOperand::R(ArmReg::sp);
+        load_inst->shift = 0;
+        load_inst->dst = allocated_reg(r);
+        set_offset(load_inst, offset_of(u->value), r);
       }
-
-      if (new_out != bb->liveout) {
-        changed = true;
-        bb->liveout = new_out;
-        std::set<MachineOperand> new_in = bb->liveuse;
-        for (auto &e : bb->liveout) {
-          if (bb->def.find(e) == bb->def.end()) {
-            new_in.insert(e);
+      std::vector<i32> stored;
+      for (auto d : defs) {
+        if (d->state != MachineOperand::State::Virtual) {
+          continue;
+        }
+        if (!reg_of.count(d->value)) {
+          reg_of[d->value] = scratch();
+        }
+        stored.push_back(d->value);
+      }
+      for (auto v : stored) {
+        auto store_inst = new MIStore();
+        store_inst->bb = bb;
+        store_inst->addr = MachineOperand::R(ArmReg::sp);
+        store_inst->shift = 0;
+        store_inst->data = allocated_reg(reg_of[v]);
+        bb->insts.insertAfter(store_inst, inst);
+        i32 offset = offset_of(v);
+        set_offset(store_inst, offset, offset < (1 << 12) ? -1 : scratch());
+      }
+      for (auto ops : {&defs, &uses}) {
+        for (auto o : *ops) {
+          if (o->state == MachineOperand::State::Virtual) {
+            *o = allocated_reg(reg_of[o->value]);
           }
         }
-
-        bb->livein = new_in;
       }
     }
-  };
+  }
+  f->stack_size += slot.size() * 4;
 }
 
+/********************************
+ * 分配耗时统计
+ * 记录每个函数的指令数、spill 轮数、耗时、是否回退到栈上和各阶段的内存，只是计数，不做分析。
+ * 设置环境变量 ALLOC_STATS_JSON 时写到它指定的文件；耗时随规模的增长由 alloc_fuzz.cpp 离线拟合
+ */
+static std::vector<AllocCost> alloc_costs;
+
+// IR 上的压力估计与指令选择之后实际的 MaxLive 的差距，统计整个程序的所有循环
+struct PressureError {
+  i32 loops = 0, under = 0, over = 0, max = 0, missed_spills = 0;
+  i64 total = 0;
 
-#define MY_ALLOCATED_ALGORITHM
+  void add(i32 ir_estimate, i32 post_isel, i32 spill_insts) {
+    i32 error = post_isel - ir_estimate;
+    loops++;
+    total += std::abs(error);
+    max = std::max(max, std::abs(error));
+    under += error > 0;
+    over += error < 0;
+    // 估计寄存器够用，实际却有 spill
+    missed_spills += ir_estimate <= ALLOCATABLE_END - ALLOCATABLE_BEGIN && spill_insts > 0;
+  }
+
+  void report() const {
+    if (loops == 0) {
+      return;
+    }
+    auto report = "IR pressure estimate over " + std::to_string(loops) + " loops: mean error " +
+                  std::to_string((double)total / loops) + ", max " + std::to_string(max) + ", " +
+                  std::to_string(under) + " under, " + std::to_string(over) + " over, " +
+                  std::to_string(missed_spills) + " loops spilled while the estimate fit";
+    dbg(report);
+  }
+};
+
+const std::vector<AllocCost> &last_alloc_costs() { return alloc_costs; }
+
+static void write_alloc_stats(const std::vector<AllocCost> &costs) {
+  auto path = std::getenv("ALLOC_STATS_JSON");
+  if (path == nullptr) {
+    return;
+  }
+  std::ofstream os(path);
+  JsonWriter json(os);
+  json.begin_object().key("functions").begin_array();
+  for (auto &c : costs) {
+    json.begin_object();
+    json.key("name").value(c.name);
+    json.key("insts").value(c.insts);
+    json.key("rounds").value(c.rounds);
+    json.key("ms").value(c.ms);
+    json.key("fallback").value(c.fallback);
+    json.key("memory").begin_object();
+    for (i32 p = 0; p < c.memory.size(); p++) {
+      auto &m = c.memory[p];
+      json.key(phase_name((Phase)p)).begin_object();
+      json.key("allocated").value(m.allocated);
+      json.key("count").value(m.count);
+      json.key("live").value(m.live);
+      json.key("peak").value(m.peak);
+      json.end_object();
+    }
+    json.end_object();
+    json.key("loops").begin_array();
+    for (auto &l : c.loops) {
+      json.begin_object();
+      json.key("depth").value(l.depth);
+      json.key("ir_estimate").value(l.ir_estimate);
+      json.key("post_isel").value(l.post_isel);
+      json.key("spill_insts").value(l.spill_insts);
+      json.end_object();
+    }
+    json.end_array();
+    json.end_object();
+  }
+  json.end_array().end_object();
+  os << std::endl;
+}
+
+/********************************
+ * 分配之后的窥孔优化
+ * 在物理寄存器上匹配几种分配和溢出之后留下的模式，每种模式分别计数：
+ * mov r, r 删除；str a, [m] 之后的 ldr b, [m] 改为 mov b, a；add/sub/orr d, s, #0 改为 mov d, s；
+ * sub d, a, b 之后 cmp d, #0 只被 eq / ne 使用时改为 cmp a, b；op t, ... 之后 mov d, t 且 t 不再活跃时改为 op d, ...
+ */
+#define POST_RA_PEEPHOLE
+
+struct PeepholeStats {
+  i32 identity_move = 0;
+  i32 store_load = 0;
+  i32 add_zero = 0;
+  i32 compare_sub = 0;
+  i32 move_fold = 0;
+};
+
+static bool same_reg(const MachineOperand &a, const MachineOperand &b) {
+  return is_physical(a) && is_physical(b) && a.value == b.value;
+}
+
+static bool reads_reg(MachineInst *inst, const MachineOperand &r) {
+  auto [def, use] = get_def_use(inst);
+  return std::any_of(use.begin(), use.end(), [&](const MachineOperand &u) { return same_reg(u, r); });
+}
+
+static bool writes_reg(MachineInst *inst, const MachineOperand &r) {
+  auto [def, use] = get_def_use(inst);
+  return std::any_of(def.begin(), def.end(), [&](const MachineOperand &d) { return same_reg(d, r); });
+}
+
+// inst 之后不会再被读到时返回 true，到块尾时看 liveout
+static bool reg_dead_after(MachineInst *inst, const MachineOperand &r, const PhysicalLiveness &live) {
+  for (auto cur = inst->next; cur; cur = cur->next) {
+    if (reads_reg(cur, r)) {
+      return false;
+    }
+    if (writes_reg(cur, r)) {
+      return true;
+    }
+  }
+  return r.value >= 16 || !(live.liveout.at(inst->bb) >> r.value & 1u);
+}
+
+static ArmCond flag_user_cond(MachineInst *inst) {
+  if (auto x = dyn_cast<MIBranch>(inst)) {
+    return x->cond;
+  } else if (auto x = dyn_cast<MIMove>(inst)) {
+    return x->cond;
+  } else if (auto x = dyn_cast<MIFma>(inst)) {
+    return x->cond;
+  }
+  return ArmCond::Any;
+}
+
+// cmp 设置的标志位只被 eq / ne 使用：扫描到下一条 cmp 为止，到块尾时继续检查后继的开头
+static bool flags_only_equality(MachineInst *cmp) {
+  auto check = [](MachineInst *from) {
+    for (auto cur = from; cur; cur = cur->next) {
+      if (isa<MICompare>(cur)) {
+        return 1;
+      }
+      auto cond = flag_user_cond(cur);
+      if (cond != ArmCond::Any && cond != ArmCond::Eq && cond != ArmCond::Ne) {
+        return -1;
+      }
+    }
+    return 0;
+  };
+  i32 r = check(cmp->next);
+  if (r != 0) {
+    return r > 0;
+  }
+  for (auto succ : cmp->bb->succ) {
+    if (succ && check(succ->insts.head) <= 0) {
+      return false;
+    }
+  }
+  return true;
+}
 
+static void peephole(MachineFunc *f, PeepholeStats &stats) {
+  // 只改变块内的值，块边界上的活跃寄存器不变，算一次即可
+  PhysicalLiveness live;
+  physical_liveness(f, live);
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst;) {
+      auto next = inst->next;
+      if (auto x = dyn_cast<MIMove>(inst)) {
+        if (x->shift.is_none() && same_reg(x->dst, x->rhs)) {
+          bb->insts.remove(inst);
+          stats.identity_move++;
+        } else if (x->cond == ArmCond::Any && x->shift.is_none() && is_physical(x->rhs) && inst->prev &&
+                   !same_reg(x->dst, x->rhs) && reg_dead_after(inst, x->rhs, live)) {
+          // 前一条指令只写 rhs 时直接写到 dst
+          auto prev = inst->prev;
+          MachineOperand *dst = nullptr;
+          if (auto y = dyn_cast<MIBinary>(prev)) {
+            dst = &y->dst;
+          } else if (auto y = dyn_cast<MIMove>(prev)) {
+            dst = y->cond == ArmCond::Any ? &y->dst : nullptr;
+          } else if (auto y = dyn_cast<MILoad>(prev)) {
+            dst = y->mode == MIAccess::Mode::Offset ? &y->dst : nullptr;
+          } else if (auto y = dyn_cast<MIGlobal>(prev)) {
+            dst = &y->dst;
+          }
+          if (dst && same_reg(*dst, x->rhs)) {
+            *dst = x->dst;
+            bb->insts.remove(inst);
+            stats.move_fold++;
+          }
+        }
+      } else if (auto x = dyn_cast<MIBinary>(inst)) {
+        bool zero = x->rhs.state == MachineOperand::State::Immediate && x->rhs.value == 0;
+        if (zero && is_physical(x->lhs) && (x->tag == MachineInst::Tag::Add || x->tag == MachineInst::Tag::Sub ||
+                     x->tag == MachineInst::Tag::Or)) {
+          if (!same_reg(x->dst, x->lhs)) {
+            auto mv = new MIMove(inst);
+            mv->bb = bb;
+            mv->dst = x->dst;
+            mv->rhs = x->lhs;
+            // mov 可能还能并入前一条指令
+            next = mv;
+          }
+          bb->insts.remove(inst);
+          stats.add_zero++;
+        }
+      } else if (auto x = dyn_cast<MICompare>(inst)) {
+        auto sub = inst->prev ? dyn_cast<MIBinary>(inst->prev) : nullptr;
+        if (sub && sub->tag == MachineInst::Tag::Sub && sub->shift.is_none() && same_reg(x->lhs, sub->dst) &&
+            x->rhs.state == MachineOperand::State::Immediate && x->rhs.value == 0 &&
+            !same_reg(sub->dst, sub->lhs) && !same_reg(sub->dst, sub->rhs) && flags_only_equality(inst)) {
+          x->lhs = sub->lhs;
+          x->rhs = sub->rhs;
+          if (reg_dead_after(inst, sub->dst, live)) {
+            bb->insts.remove(sub);
+          }
+          stats.compare_sub++;
+        }
+      } else if (auto x = dyn_cast<MIStore>(inst)) {
+        // 中间没有写内存和改写相关寄存器时，之后从同一地址 load 得到的就是 data
+        if (x->mode != MIAccess::Mode::Offset) {
+          inst = next;
+          continue;
+        }
+        for (auto cur = inst->next; cur; cur = cur->next) {
+          auto y = dyn_cast<MILoad>(cur);
+          if (y && y->mode == MIAccess::Mode::Offset && same_reg(y->addr, x->addr) && y->shift == x->shift &&
+              (same_reg(y->offset, x->offset) || (y->offset.state == MachineOperand::State::Immediate &&
+                                                  x->offset.state == MachineOperand::State::Immediate &&
+                                                  y->offset.value == x->offset.value))) {
+            if (!same_reg(y->dst, x->data)) {
+              auto mv = new MIMove(cur);
+              mv->bb = bb;
+              mv->dst = y->dst;
+              mv->rhs = x->data;
+            }
+            bb->insts.remove(cur);
+            stats.store_load++;
+            break;
+          }
+          if (isa<MIStore>(cur) || isa<MICall>(cur) || writes_reg(cur, x->data) || writes_reg(cur, x->addr) ||
+              (is_physical(x->offset) && writes_reg(cur, x->offset))) {
+            break;
+          }
+        }
+        next = inst->next;
+      }
+      inst = next;
+    }
+  }
+}
 
 // iterated register coalescing
 void allocate_register(MachineProgram *p) {
+  auto program_start = std::chrono::steady_clock::now();
+  alloc_costs.clear();
+  PressureError pressure_error;
+#ifdef EXACT_SMALL_FUNCTION_ALLOCATION
+  // 在循环中被调用的函数
+  std::set<Func *> hot_callees;
+  for (auto f = p->func.head; f; f = f->next) {
+    MachineCFG cfg;  // if-conversion 还会改变 CFG，这里不缓存
+    compute_machine_cfg(f, cfg);
+    for (auto bb = f->bb.head; bb; bb = bb->next) {
+      if (cfg.depth(bb) == 0) {
+        continue;
+      }
+      for (auto inst = bb->insts.head; inst; inst = inst->next) {
+        if (auto x = dyn_cast<MICall>(inst)) {
+          hot_callees.insert(x->func);
+        }
+      }
+    }
+  }
+#endif
+
+#ifdef POST_RA_PEEPHOLE
+  PeepholeStats peephole_stats;
+#endif
   for (auto f = p->func.head; f; f = f->next) {
-    auto loop_info = compute_loop_info(f->func);
+    auto function_start = std::chrono::steady_clock::now();
+    auto deadline = std::min(function_start + std::chrono::milliseconds(FUNCTION_BUDGET_MS),
+                             program_start + std::chrono::milliseconds(PROGRAM_BUDGET_MS));
+    auto memory_before = phase_memory_snapshot();
+    // 这个函数的各次活跃分析和 trace 局部分配共用，函数分配完后销毁
+    auto pool = make_worker_pool(f);
     dbg(f->func->func->name);
+    // IR 上的估计与指令选择之后实际的压力、分配在每个循环中加入的 spill 代码对照
+    auto ir_loops = estimate_ir_register_pressure(f->func);
+    auto isel_loops = estimate_register_pressure(f);
+    i32 isel_pressure = max_live(f);
+    invalidate_machine_cfg(f);  // if-conversion 会改变 CFG
+  #ifdef IF_CONVERSION
+    if_convert(f, pool.get());
+  #endif
+    auto &cfg = machine_cfg(f);
+  #ifdef DUMP_BLOCK_FREQUENCY
+    dump_block_frequency(f, std::cerr);
+  #endif
+  #ifdef BLOCK_PLACEMENT
+    place_blocks(f, cfg);
+  #endif
+  #ifdef ADDRESS_MODE_FOLDING
+    fold_address_modes(f);
+    reduce_address_ivs(f, cfg);
+  #endif
+  #ifdef SHARE_GLOBAL_ADDRESS
+    share_global_addresses(f, cfg);
+  #endif
+  #ifdef SINK_DEFINITIONS
+    sink_definitions(f, cfg, pool.get());
+  #endif
+    auto sp_before = sp_accesses(cfg);
+    i32 spill_count = 0;
+    bool hot_func = false;
+    bool exact_tried = false;
+  #ifdef EXACT_SMALL_FUNCTION_ALLOCATION
+    hot_func = hot_callees.count(f->func->func) > 0;
+    for (auto bb = f->bb.head; bb && !hot_func; bb = bb->next) {
+      hot_func = cfg.depth(bb) > 0;
+    }
+  #endif
     bool done = false;
     std::set<MachineOperand> spilled_nodes;
+    std::set<MachineBB*> no_local;  // 局部分配失败的 trace 中的块，之后全部交给全局分配
+  #ifdef LOOP_REGION_ALLOCATION
+    LoopSplits splits;
+    reserve_loop_splits(f, cfg, splits);
+  #endif
+    i32 first_spill_vreg = f->virtual_max;  // 此后新建的 vreg 都来自 spill
+    auto constraints = take_register_constraints(f);
+    add_default_hints(f, constraints);
+  #ifdef OPTIMISTIC_COALESCING
+    Coalescing coalescing;
+    liveness_analysis(f, pool.get());
+    coalesce_moves(f, cfg, pool.get(), constraints, coalescing);
+  #endif
+    i32 insts = 0;
+    for (auto bb = f->bb.head; bb; bb = bb->next) {
+      for (auto inst = bb->insts.head; inst; inst = inst->next) {
+        insts++;
+      }
+    }
+    i32 rounds = 0;
+    bool fallback = false;
     while (!done) {
-      liveness_analysis(f);
+      auto now = std::chrono::steady_clock::now();
+      const char *reason = nullptr;
+      if (++rounds > MAX_SPILL_ROUNDS) {
+        reason = "too many spill rounds";
+      } else if (now - function_start > std::chrono::milliseconds(FUNCTION_BUDGET_MS)) {
+        reason = "function time budget exceeded";
+      } else if (now - program_start > std::chrono::milliseconds(PROGRAM_BUDGET_MS)) {
+        reason = "program time budget exceeded";
+      }
+      if (reason) {
+        std::cerr << "warning: register allocation of " << f->func->func->name
+                  << " falls back to stack slots: " << reason << std::endl;
+        allocate_on_stack(f);
+        fallback = true;
+        break;
+      }
+      liveness_analysis(f, pool.get());
       spilled_nodes.clear();
+      bool local_failed = false;
 
     #ifdef MY_ALLOCATED_ALGORITHM
       //对控制流图线性化并对每条指令编号
-      std::set<MachineBB*> visited;
       std::vector<MachineBB*> dfs;
+    #ifdef BLOCK_PLACEMENT
+      // 使用块布局的顺序
+      for (auto bb = f->bb.head; bb; bb = bb->next) {
+        dfs.push_back(bb);
+      }
+    #else
+      std::set<MachineBB*> visited;
       std::vector<MachineBB*> stack;
 
       stack.push_back(f->bb.head);
@@ -180,227 +4154,190 @@ void allocate_register(MachineProgram *p) {
           }
         }
       }
+    #endif
 
-      std::map<MachineInst*,int> inst2int;
+      // bb_begin[i] 为 dfs[i] 第一条指令的编号，bb_begin[dfs.size()] 为总数 + 1
+      std::vector<i32> bb_begin;
       int instnum = 0;
-
       for(int i = 0;i < dfs.size();i++){
-        auto bb = dfs[i];
-        for(auto inst = bb->insts.head;inst;inst = inst->next){
+        bb_begin.push_back(instnum + 1);
+        for(auto inst = dfs[i]->insts.head;inst;inst = inst->next){
           instnum++;
-          int id = instnum;
-          inst2int.insert(std::make_pair(inst,id));
         }
       }
+      bb_begin.push_back(instnum + 1);
+      bool exact = hot_func && !exact_tried && instnum <= EXACT_MAX_INSTS;
 
-      //计算live interval : inst 粒度
-      std::map<MachineOperand*,int> operand2start;
-      std::map<MachineOperand*,int> operand2end;
-      std::map<MachineOperand,i32> allocated;
-      std::map<MachineOperand,std::vector<MachineOperand*>> inverse_ptr;
-      std::vector<MachineOperand*> start_list;
-
-      for(int i = 0;i < dfs.size();i++){
-        auto bb = dfs[i];
-        for (MachineInst *inst = bb->insts.head; inst; inst = inst->next) {
-          auto [def, use] = get_def_use_ptr(inst);
-          if (def != nullptr){
-            operand2start.insert(std::make_pair(def,inst2int[inst]));
-            operand2end.insert(std::make_pair(def,inst2int[inst]));
-            start_list.push_back(def);
-            if(inverse_ptr.find(*def) == inverse_ptr.end()){
-              std::vector<MachineOperand*> temp;
-              temp.push_back(def);
-              inverse_ptr.insert(std::make_pair(*def,temp));
-            }
-            else{
-              //assert(inverse_ptr.find(*def) == inverse_ptr.end());
-              //看看是不是会有重复的def使用相同的virtual reg  //确实没报错，说明这一块并没有被执行
-              inverse_ptr.find(*def)->second.push_back(def);
-            }
+      //冷 trace 和大 trace 的局部 vreg 不参与全局分配
+      auto traces = form_traces(dfs, bb_begin, cfg);
+      std::vector<bool> eligible(traces.size());
+      for (i32 i = 0; i < traces.size(); i++) {
+        i32 hot = 0, size = 0;
+        for (auto bb : traces[i].blocks) {
+          hot = std::max(hot, cfg.depth(bb));
+          for (auto inst = bb->insts.head; inst; inst = inst->next) {
+            size++;
+          }
+          if (no_local.count(bb)) {
+            hot = size = -1;
+            break;
           }
         }
+        eligible[i] = !exact && size >= 0 && (hot == 0 || size >= LOCAL_ALLOC_MIN_INSTS);
+      }
+      find_trace_local_vregs(f, traces, eligible);
+      std::set<MachineOperand> skip;
+      for (auto &t : traces) {
+        skip.insert(t.local.begin(), t.local.end());
       }
 
-      for(int i = 0;i < dfs.size();i++){
-        auto bb = dfs[i];
-        auto live = bb->liveout;
-        for(auto inst = bb->insts.tail;inst; inst = inst->prev){
-          for(auto live_var = live.begin(); live_var != live.end();live_var++){
-            if(inverse_ptr.find(*live_var) != inverse_ptr.end()){
-              auto v = inverse_ptr.find(*live_var)->second;
-              for(int k = 0;k < v.size();k++){
-                if(operand2end.find(v[k]) != operand2end.end() && (operand2end.find(v[k])->second < inst2int[inst])){
-                  operand2end.find(v[k])->second = inst2int[inst];
-                }
-                if(operand2start.find(v[k]) != operand2start.end() && (operand2start.find(v[k])->second > inst2int[inst])){
-                  operand2start.find(v[k])->second = inst2int[inst];
-                }
-              }
-            }
-          }
-
+      //计算live interval : inst 粒度
+      std::map<MachineOperand, i32> interval_id;
+      std::vector<MachineOperand> interval_oper;
+      IntervalSoA intervals;
+      IntervalSoA fixed;
+      build_intervals(dfs, bb_begin, skip, interval_id, interval_oper, intervals, fixed);
 
-          auto [def, use] = get_def_use_ptr(inst);
-          if(def != nullptr){
-            live.erase(*def);
-          }
-          for (MachineOperand *oper : use){
-            live.insert(*oper);
-          }
-        }
+      auto hints = resolve_hints(constraints, interval_id);
+    #ifdef LOOP_REGION_ALLOCATION
+      auto depth = interval_loop_depth(dfs, cfg, interval_id);
+      if (!allocate_by_region(intervals, fixed, depth, interval_oper, first_spill_vreg, hints, spilled_nodes,
+                              deadline)) {
+        continue;  // 下一轮开始时回退到栈上
       }
-
-      //线性扫描法分配
-      // 4-12  bug：并非按头部顺序扫描
-      int used[13];
-      for(int i = 0;i < 13;i++){
-        used[i] = 0;
+    #else
+      //线性扫描法分配，按区间起点排序
+      std::vector<i32> order(interval_oper.size());
+      for(int i = 0;i < order.size();i++){
+        order[i] = i;
       }
+      std::stable_sort(order.begin(), order.end(), [&](i32 a, i32 b) { return intervals.starts[a] < intervals.starts[b]; });
 
-      for(auto i = 0;i < dfs.size();i++){
-        auto bb = dfs[i];
-        for(auto inst = bb->insts.head;inst;inst = inst->next){
-          auto [def, use] = get_def_use_ptr(inst);
-          if((def != nullptr)&&((def->state == MachineOperand::State::Allocated) || (def->state == MachineOperand::State::PreColored))){
-            if(def->value < 13 && def->value >= 0){
-              used[def->value] = 1;
+      IntervalSoA active;
+      std::vector<i32> active_id;
+      u32 checked = 0;
+      bool out_of_time = false;
+      for (i32 id : order) {
+        if (over_budget(checked, deadline)) {
+          out_of_time = true;
+          break;
+        }
+        i32 s = intervals.starts[id];
+        i32 e = intervals.ends[id];
+        //expire old intervals
+        expire_intervals(active, active_id, s);
+
+        u32 fixed_busy = busy_mask(fixed, s, e);
+        i32 reg = hinted_free_reg(busy_mask(active, s, e) | fixed_busy, id, intervals, hints);
+        if (reg == -1) {
+          //需要spill：在能让出寄存器的 active 区间中选择结束最晚的一个
+          i32 victim = -1;
+          for (i32 k = 0; k < active.size(); k++) {
+            if (!(fixed_busy >> active.reg[k] & 1u) && (victim == -1 || active.ends[k] > active.ends[victim])) {
+              victim = k;
             }
           }
-          for (MachineOperand *oper : use){
-            if((oper->state == MachineOperand::State::Allocated) || (oper->state == MachineOperand::State::PreColored)){
-              if(oper->value < 13 && oper->value >= 0){
-                used[oper->value] = 1;
-              }
-            }
+          if (victim == -1 || e > active.ends[victim]) {
+            spilled_nodes.insert(interval_oper[id]);
+            continue;
           }
+          reg = active.reg[victim];
+          intervals.reg[active_id[victim]] = -1;
+          spilled_nodes.insert(interval_oper[active_id[victim]]);
+          active.ends[victim] = -1;  // 下一次 expire 时删除
         }
+        intervals.reg[id] = reg;
+        active.push(s, e, reg);
+        active_id.push_back(id);
       }
+      if (out_of_time) {
+        continue;  // 下一轮开始时回退到栈上
+      }
+    #endif
+      auto hint_stats = "Register hints: " + std::to_string(hints.hit) + " hit, " + std::to_string(hints.miss) + " miss";
+      dbg(hint_stats);
 
-      std::vector<MachineOperand*> active;
-      std::map<MachineOperand*,int> alloc;
-
-      for(int i = start_list.size() - 1;i > 0;i--){
-        for(int j = 0;j < i;j++){
-          auto a = start_list[j];
-          auto b = start_list[j + 1];
-          if(operand2start.find(a)->second > (operand2start.find(b)->second)){
-            start_list[j + 1] = a;
-            start_list[j] = b;
-          }
-        }
+    #ifdef OPTIMISTIC_COALESCING
+      if (undo_spilled_coalescing(coalescing, spilled_nodes)) {
+        continue;
+      }
+    #endif
+    #ifdef LOOP_REGION_ALLOCATION
+      if (undo_spilled_splits(f, splits, spilled_nodes) ||
+          split_spilled_at_loops(f, splits, constraints, spilled_nodes)) {
+        continue;
       }
+    #endif
 
-      for(int i = 0;i < start_list.size();i++){
-        auto def = start_list[i];
-        if(def->state == MachineOperand::State::Virtual){
-          //expire old intervals
-          int expire = 0;
-          for(int k = 0;k < active.size();k++){
-            if(operand2end.find(active[k])->second >= (operand2start.find(def)->second)){
-              break;
-            }
-            expire++;
-            used[active[k]->value] = 0;
-          }
-          if(expire > 0){
-            active.erase(active.begin(),active.begin() + expire);
-          }
+    #ifdef EXACT_SMALL_FUNCTION_ALLOCATION
+      if (exact && !exact_tried && !spilled_nodes.empty()) {
+        exact_tried = true;
+        exact_allocate(dfs, cfg, interval_id, interval_oper, first_spill_vreg, hints, intervals, spilled_nodes,
+                       deadline);
+      }
+    #endif
 
-          auto p = allocated.find(*def);
-          int id = -1;
-          if (p == allocated.end()) {
-            for(int k = 4;k < 13;k++){
-              if(used[k] == 0){
-                id = k;
-                break;
-              }
-            }
-            if(id == -1){
-              //需要spill
-              int active_last = operand2end.find(active[active.size() - 1])->second;
-              int now_last = operand2end.find(def)->second;
-              if(now_last > active_last){
-                spilled_nodes.insert(*def);
-              }
-              else{
-                auto sp_node = active[active.size() - 1];
-                active[active.size() - 1] = def;
-                for(int k = active.size() - 1;k > 0;k--){
-                  if(operand2end.find(active[k])->second < (operand2end.find(active[k - 1])->second)){
-                    auto temp = active[k];
-                    active[k] = active[k - 1];
-                    active[k - 1] = temp;
-                  }
-                }
-                id = sp_node->value;
-                allocated[*def] = id;
-                sp_node->state = MachineOperand::State::Virtual;
-                sp_node->value = alloc.find(sp_node)->second;
-                alloc.erase(sp_node);
-                allocated.erase(*sp_node);
-                spilled_nodes.insert(*sp_node);
-              }
-            }
-            else{
-              //不需要spill,id即可
-              allocated[*def] = id;
-              used[id] = 1;
-              active.push_back(def);
-              for(int k = active.size() - 1;k > 0;k--){
-                if(operand2end.find(active[k])->second < (operand2end.find(active[k - 1])->second)){
-                  auto temp = active[k];
-                  active[k] = active[k - 1];
-                  active[k - 1] = temp;
-                }
-              }
-            }
-          }else {
-            //这里测试，每个def都需要重新分配 //确实如此，这个是白费的
-            //assert(0 == 1);
-            id = p->second;
+      //全局分配成功后再对各 trace 做局部分配，局部 vreg 不会同时活跃在两个 trace 中，栈槽可以复用
+      std::vector<LocalPlan> local_plans;
+      std::vector<char> local_ok;
+      if (spilled_nodes.empty()) {
+        std::map<MachineOperand, i32> global_reg;
+        for (auto &[o, id] : interval_id) {
+          global_reg[o] = intervals.reg[id];
+        }
+        plan_local_traces(traces, global_reg, constraints.hints, fixed, f->stack_size, pool.get(), local_plans,
+                          local_ok);
+        for (i32 i = 0; i < traces.size(); i++) {
+          if (!local_ok[i]) {
+            dbg("Local allocation failed, falling back to global");
+            no_local.insert(traces[i].blocks.begin(), traces[i].blocks.end());
+            local_failed = true;
           }
-          if(id != -1){
-            def->state = MachineOperand::State::Allocated;
-            alloc.insert(std::make_pair(def,def->value));
-            def->value = id;
-          }         
         }
       }
 
-      for(int i = 0;i < dfs.size();i++){
-        auto bb = dfs[i];
-        for (MachineInst *inst = bb->insts.head; inst; inst = inst->next) {
-          auto [def, use] = get_def_use_ptr(inst);
-          for (MachineOperand *oper : use){
-            if (oper->state == MachineOperand::State::Virtual) {
-              auto p = allocated.find(*oper);
-              int id;
-              if (p == allocated.end()) {
-                spilled_nodes.insert(*oper);
-              }else {
-                id = p->second;
+      if (spilled_nodes.empty() && !local_failed) {
+        for(int i = 0;i < dfs.size();i++){
+          for (MachineInst *inst = dfs[i]->insts.head; inst; inst = inst->next) {
+            auto [def, use] = get_defs_use_ptr(inst);
+            use.insert(use.end(), def.begin(), def.end());
+            for (MachineOperand *oper : use){
+              auto it = interval_id.find(*oper);
+              if (oper->state == MachineOperand::State::Virtual && it != interval_id.end()) {
+                oper->value = intervals.reg[it->second];
                 oper->state = MachineOperand::State::Allocated;
-                alloc.insert(std::make_pair(oper,oper->value));
-                oper->value = id;
               }
             }
           }
         }
-      }      
+        i32 slots = 0;
+        for (auto &plan : local_plans) {
+          apply_local_plan(plan);
+          slots = std::max(slots, plan.slots);
+        }
+        f->stack_size += slots * 4;
+      }
     #endif
 
-      if (spilled_nodes.empty()) {
+      if (spilled_nodes.empty() && !local_failed) {
         done = true;
       } else {
         done = false;
-        
-        for(auto iter = alloc.begin();iter != alloc.end();iter++){
-          iter->first->state = MachineOperand::State::Virtual;
-          iter->first->value = iter->second;
-        }
-        
+
+        MemoryPhase phase(Phase::Spill);
+        spill_count += spilled_nodes.size();
+        auto defs = def_sites(f);
         for (auto &n : spilled_nodes) {
+          // 每个 vreg 的改写都要扫描整个函数，每个之前检查一次；中途停下时剩下的 vreg 交给栈上的回退
+          if (std::chrono::steady_clock::now() > deadline) {
+            break;
+          }
+          if (auto remat = find_remat(f, defs, n, spilled_nodes)) {
+            auto info = "Rematerializing v" + std::to_string(n.value);
+            dbg(info);
+            rematerialize(f, n, *remat);
+            continue;
+          }
           auto spill = "Spilling v" + std::to_string(n.value);
           dbg(spill);
           // allocate on stack
@@ -448,17 +4385,18 @@ void allocate_register(MachineProgram *p) {
             };
 
             int i = 0;
+            bool respill = n.value >= first_spill_vreg;
             for (auto orig_inst = bb->insts.head; orig_inst; orig_inst = orig_inst->next) {
-              auto [def, use] = get_def_use_ptr(orig_inst);
-              if (def && *def == n) {
-                // store
-                if (vreg == -1) {
-                  vreg = f->virtual_max++;
+              auto [defs, use] = get_defs_use_ptr(orig_inst);
+              // def 可能同时出现在 use 中（fma、条件 mov、写回的 addr），先记下来
+              MachineOperand *def = nullptr;
+              for (auto d : defs) {
+                if (*d == n) {
+                  def = d;
                 }
-                def->value = vreg;
-                last_def = orig_inst;
               }
-
+              bool is_def = def != nullptr;
+              // 先处理 use：同一条指令既读又写时，读到的必须是 load 回来的值
               for (auto &u : use) {
                 if (*u == n) {
                   // load
@@ -472,7 +4410,17 @@ void allocate_register(MachineProgram *p) {
                 }
               }
 
-              if (i++ > 30) {
+              if (is_def) {
+                // store
+                if (vreg == -1) {
+                  vreg = f->virtual_max++;
+                }
+                def->value = vreg;
+                last_def = orig_inst;
+              }
+
+              // spill 产生的 vreg 再次溢出时每条指令单独 load / store，否则区间不会变短
+              if (i++ > 30 || (respill && vreg != -1)) {
                 // don't span vreg for too long
                 checkpoint();
               }
@@ -484,5 +4432,57 @@ void allocate_register(MachineProgram *p) {
         }
       }
     }
+
+    std::map<BasicBlock *, i32> isel_at, spills_at;
+    for (auto &lp : isel_loops) {
+      isel_at[lp.header->bb] = lp.max_live;
+    }
+    for (auto [l, n] : sp_accesses(cfg)) {
+      spills_at[l->header->bb] = n - sp_before[l];
+    }
+    std::vector<LoopPressureCost> loop_costs;
+    for (auto &lp : ir_loops) {
+      auto isel = isel_at.find(lp.header);
+      if (isel == isel_at.end()) {
+        continue;
+      }
+      i32 spills = spills_at.count(lp.header) ? spills_at[lp.header] : 0;
+      loop_costs.push_back({lp.depth, lp.max_live, isel->second, spills});
+      pressure_error.add(lp.max_live, isel->second, spills);
+      auto loop = "Loop pressure at depth " + std::to_string(lp.depth) + ": IR estimate " +
+                  std::to_string(lp.max_live) + ", post-ISel MaxLive " + std::to_string(isel->second) + ", " +
+                  std::to_string(spills) + " spill loads/stores";
+      dbg(loop);
+    }
+    auto pressure = "Register pressure: post-ISel MaxLive " + std::to_string(isel_pressure) + " for " +
+                    std::to_string(ALLOCATABLE_END - ALLOCATABLE_BEGIN) + " registers, spilled " +
+                    std::to_string(spill_count) + " vregs";
+    dbg(pressure);
+  #ifdef OPTIMISTIC_COALESCING
+    remove_identity_moves(f);
+  #endif
+  #ifdef ADDRESS_MODE_FOLDING
+    fuse_post_increment(f);
+  #endif
+  #ifdef POST_RA_PEEPHOLE
+    peephole(f, peephole_stats);
+  #endif
+    fold_empty_blocks(f);
+    invalidate_machine_cfg(f);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - function_start;
+    auto memory = phase_memory_since(memory_before);
+    report_phase_memory(std::string(f->func->func->name), memory);
+    alloc_costs.push_back(
+        {std::string(f->func->func->name), insts, rounds, elapsed.count(), fallback, memory, loop_costs});
   }
+  pressure_error.report();
+  write_alloc_stats(alloc_costs);
+#ifdef POST_RA_PEEPHOLE
+  auto peephole_report = "Peephole: " + std::to_string(peephole_stats.identity_move) + " identity moves, " +
+                         std::to_string(peephole_stats.store_load) + " store-to-load, " +
+                         std::to_string(peephole_stats.add_zero) + " add #0, " +
+                         std::to_string(peephole_stats.compare_sub) + " sub+cmp, " +
+                         std::to_string(peephole_stats.move_fold) + " folded moves";
+  dbg(peephole_report);
+#endif
 }
\ No newline at end of file
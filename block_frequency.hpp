@@ -0,0 +1,10 @@
+#pragma once
+
+#include <ostream>
+
+#include "../../structure/machine_code.hpp"
+
+// 机器级块频率：静态分支概率沿循环嵌套传播得到，入口块为 1，结果按 MachineFunc 缓存
+double block_frequency(MachineFunc *f, MachineBB *bb);
+// 输出每个块的频率、循环深度和出边概率
+void dump_block_frequency(MachineFunc *f, std::ostream &os);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "../../structure/machine_code.hpp"
+
+// 机器级 CFG 上的边操作：拆分边、在块边界插入 move、删除空块
+
+// 在边 pred -> succ 上插入新块并修正跳转，返回新块
+MachineBB *split_edge(MachineFunc *f, MachineBB *pred, MachineBB *succ);
+// 在边 pred -> succ 上插入一组同时发生的 move (dst <- src)，需要时拆分边，返回插入的 move；
+// 成环的 move 借助新的 vreg 打断，所以只能在寄存器分配之前使用
+std::vector<MIMove *> insert_edge_moves(MachineFunc *f, MachineBB *pred, MachineBB *succ,
+                                       const std::vector<std::pair<MachineOperand, MachineOperand>> &moves);
+// 删除除无条件跳转外没有指令的块，前驱直接跳到它的后继
+void fold_empty_blocks(MachineFunc *f);
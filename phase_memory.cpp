@@ -0,0 +1,169 @@
+#include "phase_memory.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+static const char *phase_names[] = {"other", "liveness", "intervals", "interference", "local plan", "spill"};
+
+const char *phase_name(Phase p) { return phase_names[(i32)p]; }
+
+#ifdef TRACK_PHASE_MEMORY
+
+#include <malloc.h>
+
+struct PhaseMemoryStats {
+  std::atomic<u64> allocated{0};
+  std::atomic<u64> count{0};
+  std::atomic<i64> live{0};
+  std::atomic<i64> peak{0};
+};
+
+static PhaseMemoryStats phase_memory[(i32)Phase::Count];
+
+// 当前线程在 phase 中、上次合并之后的计数，peak 为这段时间内 live 的最大值
+struct ThreadPhaseMemory {
+  Phase phase;
+  u64 allocated;
+  u64 count;
+  i64 live;
+  i64 peak;
+};
+
+// 只有常量初始化，没有构造和析构，线程启动和退出时的分配也可以使用
+static thread_local ThreadPhaseMemory thread_memory = {Phase::Other, 0, 0, 0, 0};
+
+static void flush_thread_memory() {
+  auto &t = thread_memory;
+  if (t.count == 0 && t.live == 0) {
+    return;
+  }
+  auto &s = phase_memory[(i32)t.phase];
+  s.allocated.fetch_add(t.allocated, std::memory_order_relaxed);
+  s.count.fetch_add(t.count, std::memory_order_relaxed);
+  i64 base = s.live.fetch_add(t.live, std::memory_order_relaxed);
+  i64 live = base + t.peak;
+  for (i64 peak = s.peak.load(std::memory_order_relaxed);
+       live > peak && !s.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed);) {
+  }
+  t.allocated = t.count = 0;
+  t.live = t.peak = 0;
+}
+
+MemoryPhase::MemoryPhase(Phase p) : saved(thread_memory.phase) {
+  flush_thread_memory();
+  thread_memory.phase = p;
+}
+
+MemoryPhase::~MemoryPhase() {
+  flush_thread_memory();
+  thread_memory.phase = saved;
+}
+
+static void *tracked(void *p) {
+  if (p != nullptr) {
+    auto &t = thread_memory;
+    i64 size = malloc_usable_size(p);
+    t.allocated += size;
+    t.count++;
+    t.live += size;
+    t.peak = std::max(t.peak, t.live);
+  }
+  return p;
+}
+
+static void tracked_free(void *p) {
+  if (p != nullptr) {
+    thread_memory.live -= malloc_usable_size(p);
+    std::free(p);
+  }
+}
+
+static void *tracked_aligned(size_t size, std::align_val_t align) {
+  void *p = nullptr;
+  size_t a = std::max(static_cast<size_t>(align), sizeof(void *));
+  if (posix_memalign(&p, a, size ? size : 1) != 0) {
+    return nullptr;
+  }
+  return tracked(p);
+}
+
+void *operator new(size_t size) {
+  if (void *p = tracked(std::malloc(size ? size : 1))) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return tracked(std::malloc(size ? size : 1)); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return tracked(std::malloc(size ? size : 1)); }
+void *operator new(size_t size, std::align_val_t align) {
+  if (void *p = tracked_aligned(size, align)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void *operator new[](size_t size, std::align_val_t align) { return operator new(size, align); }
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+  return tracked_aligned(size, align);
+}
+void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+  return tracked_aligned(size, align);
+}
+void operator delete(void *p) noexcept { tracked_free(p); }
+void operator delete[](void *p) noexcept { tracked_free(p); }
+void operator delete(void *p, size_t) noexcept { tracked_free(p); }
+void operator delete[](void *p, size_t) noexcept { tracked_free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { tracked_free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { tracked_free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { tracked_free(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { tracked_free(p); }
+
+std::vector<PhaseMemorySnapshot> phase_memory_snapshot() {
+  flush_thread_memory();
+  std::vector<PhaseMemorySnapshot> snapshot;
+  for (auto &s : phase_memory) {
+    i64 live = s.live.load();
+    snapshot.push_back({s.allocated.load(), s.count.load(), live});
+    s.peak.store(live);
+  }
+  return snapshot;
+}
+
+std::vector<PhaseMemoryUsage> phase_memory_since(const std::vector<PhaseMemorySnapshot> &before) {
+  flush_thread_memory();
+  std::vector<PhaseMemoryUsage> usage;
+  for (i32 p = 0; p < (i32)Phase::Count; p++) {
+    auto &s = phase_memory[p];
+    usage.push_back({s.allocated.load() - before[p].allocated, s.count.load() - before[p].count,
+                     s.live.load() - before[p].live, std::max<i64>(s.peak.load() - before[p].live, 0)});
+  }
+  return usage;
+}
+
+#else
+
+std::vector<PhaseMemorySnapshot> phase_memory_snapshot() { return {}; }
+
+std::vector<PhaseMemoryUsage> phase_memory_since(const std::vector<PhaseMemorySnapshot> &) { return {}; }
+
+#endif
+
+void report_phase_memory(const std::string &func, const std::vector<PhaseMemoryUsage> &usage) {
+  for (i32 p = 0; p < usage.size(); p++) {
+    auto &u = usage[p];
+    if (u.count == 0) {
+      continue;
+    }
+    auto report = "Memory of " + func + " in " + phase_name((Phase)p) + ": " + std::to_string(u.allocated) +
+                  " bytes in " + std::to_string(u.count) + " allocations, " + std::to_string(u.peak) +
+                  " bytes peak";
+    dbg(report);
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../../common.hpp"
+
+// 分阶段内存统计：phase_memory.cpp 替换全局 operator new / delete，按阶段统计分配的字节数、次数、
+// 净存活的字节数和峰值。块大小取 malloc_usable_size，不加块头；计数在每个线程上不用原子操作，
+// 进出 MemoryPhase 时才合并到全局，开销小到可以在评测构建中一直打开。
+// 没有块头就不知道一块内存是在哪个阶段分配的，释放记到释放时所在的阶段，存活字节数是阶段内分配减释放的净值
+#if defined(__GLIBC__)
+#define TRACK_PHASE_MEMORY
+#endif
+
+enum class Phase { Other, Liveness, Intervals, Interference, LocalPlan, Spill, Count };
+
+const char *phase_name(Phase p);
+
+#ifdef TRACK_PHASE_MEMORY
+// 作用域内当前线程的分配都记到阶段 p，进入和离开时合并当前线程的计数
+struct MemoryPhase {
+  Phase saved;
+  explicit MemoryPhase(Phase p);
+  ~MemoryPhase();
+};
+#else
+struct MemoryPhase {
+  explicit MemoryPhase(Phase) {}
+};
+#endif
+
+struct PhaseMemorySnapshot {
+  u64 allocated;
+  u64 count;
+  i64 live;
+};
+
+struct PhaseMemoryUsage {
+  u64 allocated;
+  u64 count;
+  i64 live;
+  i64 peak;  // 超出 snapshot 时存活字节数的部分，多个线程同时分配时按合并的时机近似
+};
+
+// 合并当前线程的计数，记下各阶段当前的计数，峰值从当前存活的字节数重新算起
+std::vector<PhaseMemorySnapshot> phase_memory_snapshot();
+// snapshot 之后各阶段的统计，下标为 Phase；没有打开统计时为空
+std::vector<PhaseMemoryUsage> phase_memory_since(const std::vector<PhaseMemorySnapshot> &before);
+// 输出有分配的阶段
+void report_phase_memory(const std::string &func, const std::vector<PhaseMemoryUsage> &usage);
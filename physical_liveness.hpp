@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+
+#include "../../structure/machine_code.hpp"
+
+// 分配之后的物理寄存器活跃分析，第 i 位表示 ri
+using RegMask = uint16_t;
+
+struct PhysicalLiveness {
+  std::map<MachineBB *, RegMask> livein;
+  std::map<MachineBB *, RegMask> liveout;
+};
+
+// inst 之后活跃的寄存器为 live 时，返回 inst 之前活跃的寄存器
+RegMask step_liveness(MachineInst *inst, RegMask live);
+// 计算每个块的 livein / liveout：MICall 改写 r0 ~ r3、ip、lr，MIReturn 读 r0
+void physical_liveness(MachineFunc *f, PhysicalLiveness &live);
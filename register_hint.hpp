@@ -0,0 +1,11 @@
+#pragma once
+
+#include "../../structure/machine_code.hpp"
+
+// 寄存器偏好：指令选择等前面的 pass 填写，寄存器分配在偏好的寄存器空闲时优先使用
+// 只有 r4 ~ r12 能被分配，偏好其他寄存器不起作用
+
+// vreg 偏好物理寄存器 reg
+void hint_register(MachineFunc *f, const MachineOperand &vreg, ArmReg reg);
+// vreg 偏好与 other 相同的寄存器（双向）
+void hint_same_register(MachineFunc *f, const MachineOperand &vreg, const MachineOperand &other);
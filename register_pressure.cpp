@@ -0,0 +1,133 @@
+#include "register_pressure.hpp"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "../ir/cfg.hpp"
+
+// 指令选择之后是否占用一个 vreg
+static bool needs_register(Value *v) {
+  switch (v->tag) {
+    case Value::Tag::Store:
+    case Value::Tag::Branch:
+    case Value::Tag::Jump:
+    case Value::Tag::Return:
+    case Value::Tag::MemOp:
+    case Value::Tag::MemPhi:
+    case Value::Tag::Const:
+    case Value::Tag::Global:
+    case Value::Tag::Undef:
+      return false;
+    case Value::Tag::Param:
+      return true;
+    default:
+      break;
+  }
+  // 没有使用的值（包括 void 函数的调用）不会被分配
+  auto use = v->uses.head;
+  if (use == nullptr) {
+    return false;
+  }
+  // 只被同一块末尾的跳转使用的比较生成 cmp + 条件跳转
+  bool compare = v->tag >= Value::Tag::Lt && v->tag <= Value::Tag::Ne;
+  return !(compare && use->next == nullptr && use->user->tag == Value::Tag::Branch &&
+           use->user->bb == static_cast<Inst *>(v)->bb);
+}
+
+std::vector<IrLoopPressure> estimate_ir_register_pressure(IrFunc *f) {
+  std::vector<BasicBlock *> bbs;
+  std::map<BasicBlock *, std::set<Value *>> liveuse, def, livein, liveout, phi_uses;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    bbs.push_back(bb);
+    auto &u = liveuse[bb];
+    auto &d = def[bb];
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      if (auto phi = dyn_cast<PhiInst>(inst)) {
+        // incoming_values 与 bb->pred 一一对应
+        for (size_t k = 0; k < phi->incoming_values.size(); k++) {
+          auto v = phi->incoming_values[k].value;
+          if (needs_register(v)) {
+            phi_uses[bb->pred[k]].insert(v);
+          }
+        }
+      } else {
+        auto [begin, end] = inst->operands();
+        for (auto use = begin; use != end; use++) {
+          if (needs_register(use->value) && !d.count(use->value)) {
+            u.insert(use->value);
+          }
+        }
+      }
+      if (needs_register(inst)) {
+        d.insert(inst);
+      }
+    }
+    livein[bb] = u;
+  }
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto it = bbs.rbegin(); it != bbs.rend(); ++it) {
+      auto bb = *it;
+      std::set<Value *> out = phi_uses[bb];
+      for (auto succ : bb->succ()) {
+        if (succ) {
+          out.insert(livein[succ].begin(), livein[succ].end());
+        }
+      }
+      if (out != liveout[bb]) {
+        changed = true;
+        auto &in = livein[bb];
+        for (auto v : out) {
+          if (!def[bb].count(v)) {
+            in.insert(v);
+          }
+        }
+        liveout[bb] = std::move(out);
+      }
+    }
+  }
+
+  // 与机器级的估计相同：每个块从 liveout 向前扫描，定值的那一刻 def 与之后活跃的值同时存在
+  std::map<BasicBlock *, int> block_max;
+  for (auto bb : bbs) {
+    auto live = liveout[bb];
+    int max = live.size();
+    for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
+      if (needs_register(inst)) {
+        max = std::max(max, (int)live.size() + !live.count(inst));
+        live.erase(inst);
+      }
+      if (!isa<PhiInst>(inst)) {
+        auto [begin, end] = inst->operands();
+        for (auto use = begin; use != end; use++) {
+          if (needs_register(use->value)) {
+            live.insert(use->value);
+          }
+        }
+      }
+      max = std::max(max, (int)live.size());
+    }
+    block_max[bb] = max;
+  }
+
+  // 块计入它所在的循环和所有外层循环
+  auto info = compute_loop_info(f);
+  std::map<Loop *, int> loop_max;
+  std::vector<Loop *> order;
+  for (auto bb : bbs) {
+    auto it = info.loop_of_bb.find(bb);
+    for (Loop *l = it == info.loop_of_bb.end() ? nullptr : it->second; l; l = l->parent) {
+      auto [pos, inserted] = loop_max.insert({l, 0});
+      if (inserted) {
+        order.push_back(l);
+      }
+      pos->second = std::max(pos->second, block_max[bb]);
+    }
+  }
+  std::vector<IrLoopPressure> result;
+  for (auto l : order) {
+    result.push_back({l->header(), (int)l->depth(), loop_max[l]});
+  }
+  return result;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+#include "../../structure/machine_code.hpp"
+
+// 寄存器压力估计：按 get_def_use 的规则计算同时活跃的值的数目，
+// 分配之前的变换可以据此判断是否会导致溢出。不修改 bb 上 liveness_analysis 的结果
+
+struct LoopPressure {
+  MachineBB *header;
+  int depth;
+  int max_live;  // 循环中任意一点同时活跃的 vreg 和 r4 ~ r12 的最大数目
+};
+
+// 每个循环的 MaxLive
+std::vector<LoopPressure> estimate_register_pressure(MachineFunc *f);
+// 整个函数的 MaxLive
+int max_live(MachineFunc *f);
+
+// 指令选择之前的估计，给循环展开、内联、LICM 等 IR 上的 pass 使用。
+// 每个 SSA 值在指令选择后对应一个 vreg，参数从入口开始活跃；phi 的操作数在对应前驱的出口活跃。
+// 与指令选择一致，不产生值的指令、常量和全局地址不占寄存器，只被同一块中的跳转使用的比较直接设置标志位。
+// 指令选择引入的临时值（地址计算、放不进立即数的常量）不在其中，allocate_register 会报告与实际的差距
+struct IrLoopPressure {
+  BasicBlock *header;
+  int depth;
+  int max_live;
+};
+
+// 每个循环的 MaxLive，循环由 compute_loop_info 给出
+std::vector<IrLoopPressure> estimate_ir_register_pressure(IrFunc *f);
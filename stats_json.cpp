@@ -0,0 +1,108 @@
+#include "stats_json.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+void JsonWriter::separate() {
+  if (after_key) {
+    after_key = false;
+    return;
+  }
+  if (!first.empty()) {
+    if (!first.back()) {
+      os << ',';
+    }
+    first.back() = false;
+  }
+}
+
+void JsonWriter::string(const std::string &s) {
+  os << '"';
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (c == '\n') {
+      os << "\\n";
+    } else if (c == '\t') {
+      os << "\\t";
+    } else if (c < 0x20) {
+      char buf[8];
+      std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+      os << buf;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+JsonWriter &JsonWriter::begin_object() {
+  separate();
+  os << '{';
+  first.push_back(true);
+  return *this;
+}
+
+JsonWriter &JsonWriter::end_object() {
+  first.pop_back();
+  os << '}';
+  return *this;
+}
+
+JsonWriter &JsonWriter::begin_array() {
+  separate();
+  os << '[';
+  first.push_back(true);
+  return *this;
+}
+
+JsonWriter &JsonWriter::end_array() {
+  first.pop_back();
+  os << ']';
+  return *this;
+}
+
+JsonWriter &JsonWriter::key(const std::string &k) {
+  separate();
+  string(k);
+  os << ':';
+  after_key = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(const std::string &v) {
+  separate();
+  string(v);
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(i64 v) {
+  separate();
+  os << v;
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(u64 v) {
+  separate();
+  os << v;
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(double v) {
+  separate();
+  // JSON 没有 inf 和 nan
+  if (std::isfinite(v)) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.6g", v);
+    os << buf;
+  } else {
+    os << "null";
+  }
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(bool v) {
+  separate();
+  os << (v ? "true" : "false");
+  return *this;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "../../common.hpp"
+
+// 统计数据的 JSON 输出：按调用顺序写对象和数组，自动加逗号，字符串按 JSON 的规则转义。
+// 对象中先 key 再写值，不检查嵌套是否匹配
+class JsonWriter {
+ public:
+  explicit JsonWriter(std::ostream &os) : os(os) {}
+
+  JsonWriter &begin_object();
+  JsonWriter &end_object();
+  JsonWriter &begin_array();
+  JsonWriter &end_array();
+  JsonWriter &key(const std::string &k);
+  JsonWriter &value(const std::string &v);
+  JsonWriter &value(const char *v) { return value(std::string(v)); }
+  JsonWriter &value(i64 v);
+  JsonWriter &value(u64 v);
+  JsonWriter &value(i32 v) { return value((i64)v); }
+  JsonWriter &value(double v);
+  JsonWriter &value(bool v);
+
+ private:
+  std::ostream &os;
+  std::vector<bool> first;  // 每层嵌套中是否还没有写过元素
+  bool after_key = false;
+
+  void separate();
+  void string(const std::string &s);
+};